@@ -16,6 +16,7 @@
 
 /* All drivers initialising the SW cursor need this */
 #include "mipointer.h"
+#include "mipointrst.h"
 
 /* All drivers implementing backing store need this */
 #include "mibstore.h"
@@ -24,6 +25,7 @@
 #include "xf86fbman.h"
 #include "fb.h"
 #include "picturestr.h"
+#include "damage.h"
 
 /* All drivers using xwayland module need this */
 #include "xwayland.h"
@@ -37,6 +39,7 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 /* These need to be checked */
 #include <X11/X.h>
@@ -54,6 +57,15 @@
 
 static DevPrivateKeyRec wlshm_pixmap_private_key;
 
+/* The toplevel window a pixmap belongs to, in rootless mode */
+static DevPrivateKeyRec wlshm_pixmap_window_key;
+
+struct wlshm_pixmap *
+wlshm_get_pixmap(PixmapPtr pixmap)
+{
+    return dixLookupPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key);
+}
+
 static Bool
 window_own_pixmap(WindowPtr pWin)
 {
@@ -149,14 +161,208 @@ wlshm_adjust_frame(int scrnIndex, int x, int y, int flags)
 {
 }
 
+static void
+wlshm_copy_box(struct wlshm_device *wlshm,
+               void *dst, int dst_stride, const void *src, int src_stride,
+               int cpp, const BoxRec *box, Bool to_shm, Bool convert)
+{
+    if (convert) {
+        wlshm_convert_rect(&wlshm->threads,
+                           (char *)dst + box->y1 * dst_stride + box->x1 * cpp,
+                           dst_stride,
+                           (const char *)src + box->y1 * src_stride +
+                           box->x1 * cpp,
+                           src_stride, box->x2 - box->x1, box->y2 - box->y1);
+        return;
+    }
+
+    wlshm_copy_rect(&wlshm->threads,
+                    (char *)dst + box->y1 * dst_stride + box->x1 * cpp,
+                    dst_stride,
+                    (const char *)src + box->y1 * src_stride + box->x1 * cpp,
+                    src_stride,
+                    (box->x2 - box->x1) * cpp, box->y2 - box->y1, to_shm);
+}
+
+/*
+ * Returns the number of bytes copied.  convert turns depth 30 pixels
+ * into 8 bit ones on the way, see wlshm_convert.c.
+ */
+static size_t
+wlshm_copy_region(struct wlshm_device *wlshm,
+                  void *dst, int dst_stride, const void *src, int src_stride,
+                  int cpp, RegionPtr region, Bool to_shm, Bool convert)
+{
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    size_t bytes = 0;
+
+    while (n--) {
+        wlshm_copy_box(wlshm, dst, dst_stride, src, src_stride, cpp, box,
+                       to_shm, convert);
+        bytes += (size_t)(box->x2 - box->x1) * (box->y2 - box->y1) * cpp;
+        box++;
+    }
+
+    return bytes;
+}
+
+/*
+ * Copy what X rendered into the back buffer since the last commit
+ * forward into the shm buffer the compositor reads from.
+ */
+static void
+wlshm_pixmap_commit(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    PixmapPtr pixmap = d->pixmap;
+    RegionPtr region = DamageRegion(d->damage);
+    size_t copied;
+
+    if (!RegionNotEmpty(region))
+        return;
+
+    if (d->tile_hash)
+        wlshm->stats.tile_pixels_suppressed +=
+            wlshm_tiles_filter(&wlshm->threads, d, region);
+
+    copied = wlshm_copy_region(wlshm, d->data, d->stride,
+                               pixmap->devPrivate.ptr, pixmap->devKind,
+                               pixmap->drawable.bitsPerPixel / 8,
+                               region, TRUE, d->convert);
+    DamageEmpty(d->damage);
+
+    wlshm->stats.copy_commit_bytes += copied;
+    d->copy_bytes += copied;
+    d->commits++;
+}
+
+/*
+ * Grow what xwayland is about to post for this pixmap into fewer
+ * rectangles, see wlshm_damage.c.  xwayland's damage record can only be
+ * added to, so the simpler region is reported as damage on the window
+ * and replaces the fragments it covers.
+ *
+ * That reaches every damage record on the window, clients' DAMAGE
+ * objects included: they are told of the overdraw too, which the
+ * protocol allows, and may repaint a little more than was drawn.  The
+ * driver's own records of what needs copying back on detach are put
+ * back as they were, so the overdraw isn't copied twice.
+ */
+static void
+wlshm_pixmap_simplify_damage(struct wlshm_device *wlshm,
+                             struct wlshm_pixmap *d)
+{
+    RegionPtr region = DamageRegion(d->frame_damage);
+    int n = RegionNumRects(region);
+    RegionRec simple, drawn, back_drawn;
+
+    if (d->window &&
+        wlshm_damage_reduce(region, &simple, wlshm->damage_max_rects,
+                            wlshm->damage_rect_cost,
+                            &wlshm->stats.damage_overdraw)) {
+        wlshm->stats.damage_rects_in += n;
+        wlshm->stats.damage_rects_out += RegionNumRects(&simple);
+#ifdef COMPOSITE
+        RegionTranslate(&simple, d->pixmap->screen_x, d->pixmap->screen_y);
+#endif
+        RegionNull(&drawn);
+        RegionNull(&back_drawn);
+        if (d->damage && !d->back_buffered)
+            RegionCopy(&drawn, DamageRegion(d->damage));
+        if (d->back_damage)
+            RegionCopy(&back_drawn, DamageRegion(d->back_damage));
+
+        DamageDamageRegion(&d->window->drawable, &simple);
+        RegionUninit(&simple);
+
+        /* Already committed, nothing there needs copying again */
+        if (d->back_buffered)
+            DamageEmpty(d->damage);
+        else if (d->damage)
+            RegionCopy(DamageRegion(d->damage), &drawn);
+        if (d->back_damage)
+            RegionCopy(DamageRegion(d->back_damage), &back_drawn);
+        RegionUninit(&drawn);
+        RegionUninit(&back_drawn);
+    }
+
+    DamageEmpty(d->frame_damage);
+}
+
+static void
+wlshm_commit(struct wlshm_device *wlshm)
+{
+    struct wlshm_pixmap *d;
+    struct timespec now;
+
+    xorg_list_for_each_entry(d, &wlshm->pixmaps, link) {
+        if (d->back_buffered)
+            wlshm_pixmap_commit(wlshm, d);
+        if (d->frame_damage)
+            wlshm_pixmap_simplify_damage(wlshm, d);
+    }
+
+    if (wlshm->xwl_screen)
+        xwl_screen_post_damage(wlshm->xwl_screen);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    xorg_list_for_each_entry(d, &wlshm->pixmaps, link) {
+        if (!d->first_frame_pending)
+            continue;
+        d->first_frame_pending = FALSE;
+        wlshm_stats_record_latency(wlshm->stats.first_frame_usec,
+                                   (now.tv_sec - d->create_start.tv_sec) *
+                                   1000000 +
+                                   (now.tv_nsec - d->create_start.tv_nsec) /
+                                   1000);
+    }
+
+    wlshm->last_commit = GetTimeInMillis();
+    wlshm->stats.commits++;
+}
+
+static CARD32
+wlshm_commit_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    struct wlshm_device *wlshm = arg;
+
+    wlshm->commit_pending = FALSE;
+    wlshm_commit(wlshm);
+
+    return 0;
+}
+
+/*
+ * Clients can make the server flush thousands of times a second, far
+ * more often than the compositor can show a frame.  Commit at most once
+ * per commit interval and let a timer pick up whatever accumulated in
+ * between, so damage is never held back longer than one interval.
+ */
 static void
 wlshm_flush_callback(CallbackListPtr *list,
                      pointer user_data, pointer call_data)
 {
     struct wlshm_device *wlshm = user_data;
+    CARD32 elapsed;
 
-    if (wlshm->xwl_screen)
-        xwl_screen_post_damage(wlshm->xwl_screen);
+    wlshm->stats.flushes++;
+
+    if (wlshm->commit_pending) {
+        wlshm->stats.commits_coalesced++;
+        return;
+    }
+
+    elapsed = GetTimeInMillis() - wlshm->last_commit;
+    if (elapsed >= wlshm->commit_interval) {
+        wlshm_commit(wlshm);
+        return;
+    }
+
+    wlshm->commit_timer = TimerSet(wlshm->commit_timer, 0,
+                                   wlshm->commit_interval - elapsed,
+                                   wlshm_commit_timer, wlshm);
+    wlshm->commit_pending = TRUE;
+    wlshm->stats.commits_coalesced++;
 }
 
 static Bool
@@ -166,10 +372,23 @@ wlshm_close_screen(int scrnIndex, ScreenPtr pScreen)
     struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
 
     DeleteCallback(&FlushCallback, wlshm_flush_callback, wlshm);
+    TimerFree(wlshm->commit_timer);
+    wlshm->commit_timer = NULL;
+    wlshm->commit_pending = FALSE;
+    TimerFree(wlshm->budget_timer);
+    wlshm->budget_timer = NULL;
+    wlshm_render_fini(pScreen);
+    wlshm_video_screen_fini(pScreen);
+    wlshm_threads_fini(&wlshm->threads);
+    wlshm_pool_fini(&wlshm->pool);
+
+    wlshm_stats_dump(pScrn, 3);
+    wlshm_stats_fini(pScrn);
 
     if(pScrn->vtSema){
  	wlshm_restore(pScrn, TRUE);
-	free(wlshm->fb);
+	munmap(wlshm->fb, wlshm->fb_size);
+	wlshm->fb = NULL;
     }
 
     xwl_screen_close(wlshm->xwl_screen);
@@ -200,8 +419,96 @@ wlshm_valid_mode(int scrnIndex, DisplayModePtr mode, Bool verbose, int flags)
     return MODE_OK;
 }
 
+/*
+ * Move a pixmap back to its original storage and return its shm buffer
+ * to the pool.  Only the parts damaged while it lived in shm need
+ * copying, and nothing at all if the caller is about to throw the
+ * contents away.
+ */
 static void
-wlshm_free_window_pixmap(WindowPtr pWindow)
+wlshm_pixmap_detach(struct wlshm_device *wlshm, struct wlshm_pixmap *d,
+                    Bool keep_contents)
+{
+    PixmapPtr pixmap = d->pixmap;
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    size_t copied;
+
+    dixSetPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key, NULL);
+    xorg_list_del(&d->link);
+    if (d->retained)
+        wlshm->retained_bytes -= d->bytes;
+
+    if (d->back) {
+        if (!keep_contents)
+            copied = 0;
+        else if (d->back_damage)
+            copied = wlshm_copy_region(wlshm, d->orig, d->orig_stride,
+                                       d->back, pixmap->devKind,
+                                       pixmap->drawable.bitsPerPixel / 8,
+                                       DamageRegion(d->back_damage), FALSE);
+        else {
+            wlshm_copy_rect(&wlshm->threads,
+                            d->orig, d->orig_stride, d->back, pixmap->devKind,
+                            d->stride, pixmap->drawable.height, FALSE);
+            copied = d->bytes;
+        }
+        wlshm->stats.copy_out_bytes += copied;
+        wlshm->stats.copy_saved_bytes += d->bytes - copied;
+
+        if (d->back_damage) {
+            DamageUnregister(&pixmap->drawable, d->back_damage);
+            DamageDestroy(d->back_damage);
+        }
+        (*pScreen->ModifyPixmapHeader)(pixmap, 0, 0, 0, 0,
+                                       d->orig_stride, d->orig);
+        free(d->back);
+    }
+
+    /* With a back buffer X never rendered into shm, orig is current */
+    if (!d->back_buffered) {
+        pixmap->devPrivate.ptr = d->orig;
+        pixmap->devPrivate.fptr = d->orig;
+
+        if (!keep_contents)
+            copied = 0;
+        else if (d->released) {
+            /* No point faulting the pages back in to copy them out */
+            wlshm_budget_unpack(wlshm, d, d->orig, d->orig_stride);
+            copied = d->bytes;
+        } else if (d->damage)
+            copied = wlshm_copy_region(wlshm, d->orig, d->orig_stride,
+                                       d->data, d->stride,
+                                       pixmap->drawable.bitsPerPixel / 8,
+                                       DamageRegion(d->damage), FALSE, FALSE);
+        else {
+            wlshm_copy_rect(&wlshm->threads,
+                            d->orig, d->orig_stride, d->data, d->stride,
+                            d->stride, pixmap->drawable.height, FALSE);
+            copied = d->bytes;
+        }
+
+        wlshm->stats.copy_out_bytes += copied;
+        wlshm->stats.copy_saved_bytes += d->bytes - copied;
+    }
+
+    if (d->damage) {
+        DamageUnregister(&pixmap->drawable, d->damage);
+        DamageDestroy(d->damage);
+    }
+    if (d->frame_damage) {
+        DamageUnregister(&pixmap->drawable, d->frame_damage);
+        DamageDestroy(d->frame_damage);
+    }
+    wlshm_budget_forget(wlshm, d);
+    wlshm_tiles_detach(d);
+    wlshm_pool_put(&wlshm->pool, d->buffer);
+    wlshm->stats.detached++;
+
+    free(d);
+}
+
+static void
+wlshm_free_window_pixmap(WindowPtr pWindow, Bool keep_contents)
 {
     ScreenPtr pScreen = pWindow->drawable.pScreen;
     struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
@@ -219,15 +526,52 @@ wlshm_free_window_pixmap(WindowPtr pWindow)
     if (!d)
         return ;
 
-    dixSetPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key, NULL);
+    wlshm_pixmap_detach(wlshm, d, keep_contents);
+}
+
+/*
+ * Unmapped windows keep their shm buffer for a while, so that mapping
+ * them again (minimise and restore, a menu popping up again) only needs
+ * a new wl_buffer and no copies.  Retained buffers are kept in LRU
+ * order; past the byte budget, the oldest are detached for real.
+ */
+static void
+wlshm_retain_window_pixmap(WindowPtr pWindow)
+{
+    ScreenPtr pScreen = pWindow->drawable.pScreen;
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+    struct wlshm_pixmap *d;
+    PixmapPtr pixmap;
+
+    if (!xorgRootless && pWindow->parent)
+	return;
 
-    pixmap->devPrivate.ptr = d->orig;
-    pixmap->devPrivate.fptr = d->orig;
-    memcpy(d->orig, d->data, d->bytes);
-    munmap(d->data, d->bytes);
-    close(d->fd);
+    pixmap = pScreen->GetWindowPixmap(pWindow);
+    if (!pixmap)
+        return;
 
-    free(d);
+    d = dixLookupPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key);
+    if (!d || d->retained)
+        return;
+
+    if (d->bytes > wlshm->retain_limit) {
+        wlshm_pixmap_detach(wlshm, d, TRUE);
+        return;
+    }
+
+    xorg_list_del(&d->link);
+    xorg_list_add(&d->link, &wlshm->retained);
+    d->retained = TRUE;
+    d->retained_since = GetTimeInMillis();
+    wlshm->retained_bytes += d->bytes;
+
+    while (wlshm->retained_bytes > wlshm->retain_limit) {
+        d = xorg_list_last_entry(&wlshm->retained, struct wlshm_pixmap, link);
+        wlshm_pixmap_detach(wlshm, d, TRUE);
+        wlshm->stats.retain_evictions++;
+    }
+
+    wlshm_budget_enforce(wlshm);
 }
 
 static Bool
@@ -235,9 +579,24 @@ wlshm_destroy_window(WindowPtr pWindow)
 {
     ScreenPtr pScreen = pWindow->drawable.pScreen;
     struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+    struct wlshm_pixmap *d;
+    PixmapPtr pixmap;
     Bool ret;
 
-    wlshm_free_window_pixmap(pWindow);
+    wlshm_free_window_pixmap(pWindow, FALSE);
+
+    /* Pixmaps can outlive their window, with composite */
+    pixmap = pScreen->GetWindowPixmap(pWindow);
+    if (xorgRootless && pixmap &&
+        dixLookupPrivate(&pixmap->devPrivates,
+                         &wlshm_pixmap_window_key) == pWindow)
+        dixSetPrivate(&pixmap->devPrivates, &wlshm_pixmap_window_key, NULL);
+    xorg_list_for_each_entry(d, &wlshm->pixmaps, link)
+        if (d->window == pWindow)
+            d->window = NULL;
+    xorg_list_for_each_entry(d, &wlshm->retained, link)
+        if (d->window == pWindow)
+            d->window = NULL;
 
     pScreen->DestroyWindow = wlshm->DestroyWindow;
     ret = (*pScreen->DestroyWindow)(pWindow);
@@ -254,7 +613,7 @@ wlshm_unrealize_window(WindowPtr pWindow)
     struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
     Bool ret;
 
-    wlshm_free_window_pixmap(pWindow);
+    wlshm_retain_window_pixmap(pWindow);
 
     pScreen->UnrealizeWindow = wlshm->UnrealizeWindow;
     ret = (*pScreen->UnrealizeWindow)(pWindow);
@@ -270,13 +629,21 @@ wlshm_set_window_pixmap(WindowPtr pWindow, PixmapPtr pPixmap)
     ScreenPtr pScreen = pWindow->drawable.pScreen;
     struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
 
-    wlshm_free_window_pixmap(pWindow);
+    wlshm_free_window_pixmap(pWindow, TRUE);
 
     pScreen->SetWindowPixmap = wlshm->SetWindowPixmap;
     (*pScreen->SetWindowPixmap)(pWindow, pPixmap);
     wlshm->SetWindowPixmap = pScreen->SetWindowPixmap;
     pScreen->SetWindowPixmap = wlshm_set_window_pixmap;
 
+    /*
+     * Composite also hands a redirected window's pixmap to each of its
+     * children, which are neither its owner nor live as long.
+     */
+    if (xorgRootless && pPixmap && window_own_pixmap(pWindow))
+        dixSetPrivate(&pPixmap->devPrivates, &wlshm_pixmap_window_key,
+                      pWindow);
+
     /* xwayland will call create_window_buffer later */
 }
 
@@ -300,9 +667,71 @@ wlshm_create_window(WindowPtr pWin)
                                       pWin->drawable.height,
                                       pWin->drawable.depth, 0);
     _fbSetWindowPixmap(pWin, pixmap);
+    if (pixmap)
+        dixSetPrivate(&pixmap->devPrivates, &wlshm_pixmap_window_key, pWin);
     return ret;
 }
 
+/*
+ * xwayland hands the cursor image to the compositor with
+ * wl_pointer.set_cursor, replacing the sprite functions of miPointer
+ * from xwl_screen_init.  The software cursor layer would never be up,
+ * yet would still sit in front of every GetImage, GetSpans and
+ * CopyWindow, so unless the SWCursor option asks for it, miPointer is
+ * set up with these until xwayland takes over.
+ */
+static Bool
+wlshm_realize_cursor(DeviceIntPtr pDev, ScreenPtr pScreen, CursorPtr pCurs)
+{
+    return TRUE;
+}
+
+static void
+wlshm_set_cursor(DeviceIntPtr pDev, ScreenPtr pScreen, CursorPtr pCurs,
+                 int x, int y)
+{
+}
+
+static void
+wlshm_move_cursor(DeviceIntPtr pDev, ScreenPtr pScreen, int x, int y)
+{
+}
+
+static Bool
+wlshm_device_cursor_initialize(DeviceIntPtr pDev, ScreenPtr pScreen)
+{
+    return TRUE;
+}
+
+static void
+wlshm_device_cursor_cleanup(DeviceIntPtr pDev, ScreenPtr pScreen)
+{
+}
+
+static miPointerSpriteFuncRec wlshm_pointer_sprite_funcs = {
+    wlshm_realize_cursor,
+    wlshm_realize_cursor,
+    wlshm_set_cursor,
+    wlshm_move_cursor,
+    wlshm_device_cursor_initialize,
+    wlshm_device_cursor_cleanup
+};
+
+static void
+wlshm_check_cursor(ScrnInfoPtr pScrn, ScreenPtr pScreen)
+{
+    miPointerScreenPtr priv;
+
+    priv = dixLookupPrivate(&pScreen->devPrivates, miPointerScreenKey);
+    if (priv->spriteFuncs == &wlshm_pointer_sprite_funcs)
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "xwayland didn't take over the cursor, "
+                   "use Option \"SWCursor\" to show one\n");
+    else
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Cursor drawn by the compositor\n");
+}
+
 static Bool
 wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 {
@@ -310,9 +739,12 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     struct wlshm_device *wlshm;
     int ret;
     VisualPtr visual;
+    size_t prep_limit;
 
     if (!dixRegisterPrivateKey(&wlshm_pixmap_private_key, PRIVATE_PIXMAP, 0))
         return BadAlloc;
+    if (!dixRegisterPrivateKey(&wlshm_pixmap_window_key, PRIVATE_PIXMAP, 0))
+        return BadAlloc;
     /*
      * we need to get the ScrnInfoRec for this screen, so let's allocate
      * one first thing
@@ -343,10 +775,30 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     if (!miSetPixmapDepths())
         return FALSE;
 
-    wlshm->fb = malloc(pScrn->virtualX * pScrn->virtualY * pScrn->bitsPerPixel);
-
-    if (!wlshm)
+    /*
+     * Pages of the root framebuffer are only committed once something
+     * draws to them.  In rootless mode nothing ever shows the root
+     * window, so most of it is never touched at all.
+     */
+    wlshm->fb_size = (size_t)pScrn->virtualY *
+        ((pScrn->displayWidth * pScrn->bitsPerPixel + 31) / 32) * 4;
+    wlshm->fb = mmap(NULL, wlshm->fb_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (wlshm->fb == MAP_FAILED) {
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "can't allocate framebuffer: %s\n", strerror(errno));
+        wlshm->fb = NULL;
 	return FALSE;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Huge pages would commit the rootless framebuffer 2 MiB at a time */
+    if (!xorgRootless && wlshm->huge_pages &&
+        wlshm->fb_size >= WLSHM_HUGE_THRESHOLD &&
+        madvise(wlshm->fb, wlshm->fb_size, MADV_HUGEPAGE) == 0)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Framebuffer backed by transparent huge pages\n");
+#endif
 
     /*
      * Call the framebuffer layer's ScreenInit function, and fill in other
@@ -376,6 +828,7 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 
     /* must be after RGB ordering fixed */
     fbPictureInit(pScreen, 0, 0);
+    wlshm_render_init(pScreen);
 
     xf86SetBlackWhitePixels(pScreen);
 
@@ -394,8 +847,22 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     xf86SetBackingStore(pScreen);
     xf86SetSilkenMouse(pScreen);
 
+    /*
+     * The software cursor used to set up damage for the screen.  Without
+     * it, do so here, after wlshm_render_init(), so that Composite is
+     * wrapped by damage outside the banded composite and sees all of it.
+     */
+    if (!wlshm->sw_cursor && !DamageSetup(pScreen))
+        return FALSE;
+
     /* Initialise cursor functions */
-    miDCInitialize (pScreen, xf86GetPointerScreenFuncs());
+    if (wlshm->sw_cursor)
+        miDCInitialize (pScreen, xf86GetPointerScreenFuncs());
+    else if (!miPointerInitialize(pScreen, &wlshm_pointer_sprite_funcs,
+                                  xf86GetPointerScreenFuncs(), FALSE))
+        return FALSE;
+
+    wlshm_video_screen_init(pScreen);
 
     /* FIXME: colourmap */
     miCreateDefColormap(pScreen);
@@ -422,7 +889,28 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     wlshm->SetWindowPixmap = pScreen->SetWindowPixmap;
     pScreen->SetWindowPixmap = wlshm_set_window_pixmap;
 
+    /* Populated ahead of time is resident: keep it a fraction of a budget */
+    prep_limit = 0;
+    if (wlshm->prefault) {
+        prep_limit = WLSHM_PREP_LIMIT;
+        if (wlshm->budget)
+            prep_limit = min(prep_limit, wlshm->budget / 4);
+    }
+    wlshm_pool_init(&wlshm->pool, pScrn, wlshm->pool_limit,
+                    wlshm->huge_pages, prep_limit);
+    /* Maximised and fullscreen windows are the ones worth having ready */
+    if (xorgRootless)
+        wlshm_pool_expect(&wlshm->pool,
+                          (size_t)pScrn->virtualX * pScrn->virtualY *
+                          (pScrn->bitsPerPixel / 8));
+    xorg_list_init(&wlshm->pixmaps);
+    xorg_list_init(&wlshm->retained);
+
+    if (!wlshm_threads_init(&wlshm->threads, pScrn, wlshm->num_threads))
+        return FALSE;
+
     AddCallback(&FlushCallback, wlshm_flush_callback, wlshm);
+    wlshm_stats_init(pScrn);
 
     /* Report any unused options (only for the first generation) */
     if (serverGeneration == 1) {
@@ -431,21 +919,87 @@ wlshm_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 
     miScreenDevPrivateInit(pScreen, pScreen->width, wlshm->fb);
 
-    if (wlshm->xwl_screen)
-	return (xwl_screen_init(wlshm->xwl_screen, pScreen) == Success);
+    if (wlshm->xwl_screen) {
+	if (xwl_screen_init(wlshm->xwl_screen, pScreen) != Success)
+	    return FALSE;
+	if (!wlshm->sw_cursor)
+	    wlshm_check_cursor(pScrn, pScreen);
+    }
 
     return TRUE;
 }
 
+/*
+ * The shm buffer has to be tightly packed, that's the stride xwayland
+ * gives the compositor.  The back buffer is ours though: when fb's
+ * stride isn't a multiple of the cache line size, move the pixmap to
+ * storage whose rows all start on a cache line, so pixman's SIMD paths
+ * and our own row copies never straddle one.
+ */
+static void
+wlshm_pixmap_align_back_buffer(struct wlshm_device *wlshm,
+                               struct wlshm_pixmap *d)
+{
+    PixmapPtr pixmap = d->pixmap;
+    ScreenPtr pScreen = pixmap->drawable.pScreen;
+    int width = pixmap->drawable.width * pixmap->drawable.bitsPerPixel / 8;
+    int stride;
+
+    stride = (width + WLSHM_STRIDE_ALIGN - 1) & ~(WLSHM_STRIDE_ALIGN - 1);
+    if (pixmap->devKind == stride)
+        return;
+
+    if (posix_memalign(&d->back, WLSHM_STRIDE_ALIGN,
+                       (size_t)stride * pixmap->drawable.height) != 0) {
+        d->back = NULL;
+        return;
+    }
+
+    wlshm_copy_rect(&wlshm->threads, d->back, stride,
+                    d->orig, d->orig_stride,
+                    width, pixmap->drawable.height, FALSE);
+    (*pScreen->ModifyPixmapHeader)(pixmap, 0, 0, 0, 0, stride, d->back);
+
+    /* Without it, detaching copies all of back to orig */
+    d->back_damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
+                                  pScreen, NULL);
+    if (d->back_damage)
+        DamageRegister(&pixmap->drawable, d->back_damage);
+}
+
 static int
 wlshm_create_window_buffer(struct xwl_window *xwl_window,
                            PixmapPtr pixmap)
 {
     ScreenPtr pScreen = pixmap->drawable.pScreen;
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
-    char filename[] = "/tmp/wayland-shm-XXXXXX";
+    struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
     int ret = BadAlloc;
     struct wlshm_pixmap *d;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Mapped again while its buffer was retained, just reattach it */
+    d = dixLookupPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key);
+    if (d && d->retained) {
+        xorg_list_del(&d->link);
+        xorg_list_add(&d->link, &wlshm->pixmaps);
+        d->retained = FALSE;
+        wlshm->retained_bytes -= d->bytes;
+        wlshm_budget_restore(wlshm, d);
+
+        ret = xwl_create_window_buffer_shm(xwl_window, pixmap, d->buffer->fd);
+        if (ret != Success) {
+            wlshm_pixmap_detach(wlshm, d, TRUE);
+            return ret;
+        }
+
+        wlshm->stats.retain_hits++;
+        d->create_start = start;
+        d->first_frame_pending = TRUE;
+        return ret;
+    }
 
     d = calloc(sizeof (struct wlshm_pixmap), 1);
     if (!d) {
@@ -453,53 +1007,106 @@ wlshm_create_window_buffer(struct xwl_window *xwl_window,
                    strerror(errno));
         goto exit;
     }
-    d->fd = -1;
-    d->data = MAP_FAILED;
 
-    d->fd = mkstemp(filename);
-    if (d->fd < 0) {
-	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "open %s failed: %s\n",
-                   filename, strerror(errno));
-        goto exit;
-    }
+    d->pixmap = pixmap;
+    d->stride = pixmap->drawable.width * pixmap->drawable.bitsPerPixel / 8;
+    d->bytes = d->stride * pixmap->drawable.height;
 
-    d->bytes = pixmap->drawable.width * pixmap->drawable.height
-        * pixmap->drawable.bitsPerPixel / 8;
+    d->buffer = wlshm_pool_get(&wlshm->pool, d->bytes);
+    if (!d->buffer)
+        goto exit;
+    d->data = d->buffer->data;
 
-    if (ftruncate(d->fd, d->bytes) < 0) {
-	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "ftruncate failed: %s\n",
-                   strerror(errno));
+    ret = xwl_create_window_buffer_shm(xwl_window, pixmap, d->buffer->fd);
+    if (ret != Success) {
         goto exit;
     }
 
-    d->data = mmap(NULL, d->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
-    unlink(filename);
+    d->orig = pixmap->devPrivate.ptr;
+    d->orig_stride = pixmap->devKind;
 
-    if (d->data == MAP_FAILED) {
-        xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "mmap failed: %s\n",
-                   strerror(errno));
-        goto exit;
+    /*
+     * Track what X draws from now on: that's what needs copying back
+     * when the buffer goes away, or forward on flush when back
+     * buffered.
+     */
+    d->damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
+                             pScreen, NULL);
+    if (d->damage)
+        DamageRegister(&pixmap->drawable, d->damage);
+
+    /* What gets posted on the next commit, for simplifying it */
+    if (wlshm->damage_max_rects > 0) {
+        d->window = xorgRootless ?
+            dixLookupPrivate(&pixmap->devPrivates, &wlshm_pixmap_window_key) :
+            pScreen->root;
+        if (d->window)
+            d->frame_damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE,
+                                           pScreen, NULL);
+        if (d->frame_damage)
+            DamageRegister(&pixmap->drawable, d->frame_damage);
     }
 
-    ret = xwl_create_window_buffer_shm(xwl_window, pixmap, d->fd);
-    if (ret != Success) {
-        goto exit;
+    if (wlshm->back_buffer) {
+        /*
+         * Keep X rendering into the original pixmap and only copy the
+         * damaged parts forward on flush, for TileFilter and
+         * ConvertDepth30.  There is still just the one shm buffer, and
+         * the flush copy can land while the compositor is reading it.
+         */
+        if (d->damage)
+            d->back_buffered = TRUE;
+        else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "can't track damage, rendering straight to shm\n");
     }
 
-    d->orig = pixmap->devPrivate.ptr;
-    pixmap->devPrivate.ptr = d->data;
-    pixmap->devPrivate.fptr = d->data;
-    memcpy(d->data, d->orig, d->bytes);
+    /* Only the back buffer is depth 30, shm gets 8 bits per channel */
+    d->convert = d->back_buffered && wlshm->convert_depth30 &&
+        pixmap->drawable.depth == 30;
+
+    if (d->convert)
+        wlshm_convert_rect(&wlshm->threads,
+                           d->data, d->stride, d->orig, pixmap->devKind,
+                           pixmap->drawable.width, pixmap->drawable.height);
+    else
+        wlshm_copy_rect(&wlshm->threads,
+                        d->data, d->stride, d->orig, pixmap->devKind,
+                        d->stride, pixmap->drawable.height, TRUE);
+    wlshm->stats.copy_in_bytes += d->bytes;
+    d->copy_bytes = d->bytes;
+
+    if (d->back_buffered) {
+        wlshm_pixmap_align_back_buffer(wlshm, d);
+        if (wlshm->tile_filter)
+            wlshm_tiles_attach(d);
+    }
+
+    if (!d->back_buffered) {
+        pixmap->devPrivate.ptr = d->data;
+        pixmap->devPrivate.fptr = d->data;
+    }
 
     dixSetPrivate(&pixmap->devPrivates, &wlshm_pixmap_private_key, d);
+    xorg_list_add(&d->link, &wlshm->pixmaps);
+
+    d->attach_time = GetTimeInMillis();
+    wlshm->stats.attached++;
+    wlshm->stats.attached_bytes += d->bytes;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wlshm_stats_record_latency(wlshm->stats.create_usec,
+                               (end.tv_sec - start.tv_sec) * 1000000 +
+                               (end.tv_nsec - start.tv_nsec) / 1000);
+    d->create_start = start;
+    d->first_frame_pending = TRUE;
+
+    wlshm_budget_enforce(wlshm);
 
     return ret;
 exit:
     if (d) {
-        if (d->fd != -1)
-            close(d->fd);
-        if (d->data != MAP_FAILED)
-            munmap(d->data, d->bytes);
+        if (d->buffer)
+            wlshm_pool_put(&wlshm->pool, d->buffer);
         free(d);
     }
 
@@ -511,7 +1118,34 @@ static struct xwl_driver xwl_driver = {
     .create_window_buffer = wlshm_create_window_buffer
 };
 
+typedef enum {
+    OPTION_SHM_POOL_LIMIT,
+    OPTION_COMMIT_RATE,
+    OPTION_COPY_THREADS,
+    OPTION_HUGE_PAGES,
+    OPTION_RETAIN_LIMIT,
+    OPTION_MEMORY_BUDGET,
+    OPTION_TILE_FILTER,
+    OPTION_PREFAULT,
+    OPTION_DAMAGE_MAX_RECTS,
+    OPTION_DAMAGE_RECT_COST,
+    OPTION_SW_CURSOR,
+    OPTION_CONVERT_DEPTH30,
+} wlshm_opts;
+
 static const OptionInfoRec wlshm_options[] = {
+    { OPTION_SHM_POOL_LIMIT, "ShmPoolLimit", OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_COMMIT_RATE,  "CommitRate",   OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_COPY_THREADS, "CopyThreads",  OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_HUGE_PAGES,   "HugePages",    OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_RETAIN_LIMIT, "RetainLimit",  OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_MEMORY_BUDGET, "MemoryBudget", OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_TILE_FILTER,  "TileFilter",   OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_PREFAULT,     "Prefault",     OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_DAMAGE_MAX_RECTS, "DamageMaxRects", OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_DAMAGE_RECT_COST, "DamageRectCost", OPTV_INTEGER,	{0}, FALSE },
+    { OPTION_SW_CURSOR,    "SWCursor",     OPTV_BOOLEAN,	{0}, FALSE },
+    { OPTION_CONVERT_DEPTH30, "ConvertDepth30", OPTV_BOOLEAN,	{0}, FALSE },
     { -1,                  NULL,           OPTV_NONE,	{0}, FALSE }
 };
 
@@ -522,6 +1156,8 @@ wlshm_pre_init(ScrnInfoPtr pScrn, int flags)
     int i;
     GDevPtr device;
     int flags24;
+    int rate;
+    MessageType from;
 
     if (flags & PROBE_DETECT)
 	return TRUE;
@@ -543,6 +1179,8 @@ wlshm_pre_init(ScrnInfoPtr pScrn, int flags)
     pScrn->monitor = pScrn->confScreen->monitor;
 
     xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Initializing Wayland SHM driver\n");
+    xf86DrvMsg(pScrn->scrnIndex, X_PROBED, "Using %s copy routines\n",
+               wlshm_copy_kernel_name());
 
     flags24 = Support32bppFb | SupportConvert24to32 | PreferConvert24to32;
     if (!xf86SetDepthBpp(pScrn, 0, 0, 0, flags24)) {
@@ -602,6 +1240,113 @@ wlshm_pre_init(ScrnInfoPtr pScrn, int flags)
 
     xf86ProcessOptions(pScrn->scrnIndex, pScrn->options, wlshm->options);
 
+    wlshm->pool_limit = WLSHM_POOL_DEFAULT_LIMIT;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_SHM_POOL_LIMIT, &i)) {
+        if (i >= 0) {
+            wlshm->pool_limit = (size_t)i << 20;
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Keeping up to %d MB of unused shm buffers\n", i);
+        } else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "ignoring negative ShmPoolLimit %d\n", i);
+    }
+
+    wlshm->retain_limit = WLSHM_RETAIN_DEFAULT_LIMIT;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_RETAIN_LIMIT, &i)) {
+        if (i >= 0) {
+            wlshm->retain_limit = (size_t)i << 20;
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Retaining up to %d MB of unmapped window buffers\n", i);
+        } else
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "ignoring negative RetainLimit %d\n", i);
+    }
+
+    /* The main thread takes a share of the work too */
+    wlshm->num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (wlshm->num_threads > WLSHM_DEFAULT_THREADS)
+        wlshm->num_threads = WLSHM_DEFAULT_THREADS;
+    from = X_DEFAULT;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_COPY_THREADS, &i)) {
+        wlshm->num_threads = i;
+        from = X_CONFIG;
+    }
+    if (wlshm->num_threads < 0)
+        wlshm->num_threads = 0;
+    xf86DrvMsg(pScrn->scrnIndex, from, "Using %d copy threads\n",
+               wlshm->num_threads);
+
+    wlshm->huge_pages = xf86ReturnOptValBool(wlshm->options,
+                                             OPTION_HUGE_PAGES, TRUE);
+    wlshm->prefault = xf86ReturnOptValBool(wlshm->options,
+                                           OPTION_PREFAULT, FALSE);
+
+    if (xf86GetOptValBool(wlshm->options, OPTION_SW_CURSOR,
+                          &wlshm->sw_cursor))
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Software cursor %s\n",
+                   wlshm->sw_cursor ? "enabled" : "disabled");
+
+    /*
+     * At depth 30 X renders 10 bits per channel into the back buffer and
+     * only the damage is converted into 8 bit window buffers on commit.
+     */
+    if (pScrn->depth == 30)
+        wlshm->convert_depth30 = xf86ReturnOptValBool(wlshm->options,
+                                                      OPTION_CONVERT_DEPTH30,
+                                                      TRUE);
+    if (wlshm->convert_depth30)
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Converting depth 30 window buffers to XRGB8888 "
+                   "using %s routines\n", wlshm_convert_kernel_name());
+
+    if (xf86GetOptValBool(wlshm->options, OPTION_TILE_FILTER,
+                          &wlshm->tile_filter))
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Tile filtering %s, using %s hashing\n",
+                   wlshm->tile_filter ? "enabled" : "disabled",
+                   wlshm_tiles_kernel_name());
+
+    /*
+     * Both need shm to differ from what X rendered, so X renders into a
+     * back buffer and damage is copied forward on commit.  That is not
+     * double buffering: xwayland owns the wl_buffer and its release, so
+     * there is still just the one shm buffer per window.
+     */
+    wlshm->back_buffer = wlshm->convert_depth30 || wlshm->tile_filter;
+
+    wlshm->damage_max_rects = WLSHM_DAMAGE_DEFAULT_MAX_RECTS;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_DAMAGE_MAX_RECTS, &i)) {
+        wlshm->damage_max_rects = max(i, 0);
+        if (wlshm->damage_max_rects)
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Posting at most %d damage rectangles per window\n",
+                       wlshm->damage_max_rects);
+        else
+            xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                       "Damage simplification disabled\n");
+    }
+    wlshm->damage_rect_cost = WLSHM_DAMAGE_DEFAULT_RECT_COST;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_DAMAGE_RECT_COST, &i)) {
+        wlshm->damage_rect_cost = max(i, 0);
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "A damage rectangle costs as much as %d pixels\n",
+                   wlshm->damage_rect_cost);
+    }
+
+    wlshm->budget = 0;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_MEMORY_BUDGET, &i) &&
+        i > 0) {
+        wlshm->budget = (size_t)i << 20;
+        xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+                   "Keeping at most %d MB of window buffers resident\n", i);
+#ifndef HAVE_LZ4
+        if (!wlshm->back_buffer)
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "built without lz4, MemoryBudget only trims the "
+                       "buffer pool\n");
+#endif
+    }
+
     wlshm->xwl_screen = xwl_screen_create();
     if (!wlshm->xwl_screen) {
         xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "Failed to initialize xwayland.\n");
@@ -643,6 +1388,23 @@ wlshm_pre_init(ScrnInfoPtr pScrn, int flags)
     /* Print the list of modes being used */
     xf86PrintModes(pScrn);
 
+    /* Pace commits to the refresh rate unless told otherwise */
+    rate = pScrn->currentMode->VRefresh > 0 ?
+        (int)(pScrn->currentMode->VRefresh + 0.5) : 60;
+    from = X_DEFAULT;
+    if (xf86GetOptValInteger(wlshm->options, OPTION_COMMIT_RATE, &i)) {
+        rate = i;
+        from = X_CONFIG;
+    }
+    if (rate > 0) {
+        wlshm->commit_interval = 1000 / rate;
+        xf86DrvMsg(pScrn->scrnIndex, from,
+                   "Committing at most %d times per second\n", rate);
+    } else {
+        wlshm->commit_interval = 0;
+        xf86DrvMsg(pScrn->scrnIndex, from, "Commit pacing disabled\n");
+    }
+
     /* If monitor resolution is set on the command line, use it */
     xf86SetDpi(pScrn, 0, 0);
 
@@ -780,6 +1542,10 @@ wlshm_setup(pointer module, pointer opts, int *errmaj, int *errmin)
     if (!initialized) {
         initialized = TRUE;
         xf86AddDriver(&wlshm, module, HaveDriverFuncs);
+        wlshm_copy_init();
+        wlshm_convert_init();
+        wlshm_tiles_init();
+        wlshm_yuv_init();
 
 	/*
 	 * Modules that this driver always requires can be loaded here
@@ -12,6 +12,146 @@
 #include <string.h>
 
 #include "xwayland.h"
+#include "list.h"
+#include "damage.h"
+#include "picturestr.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+typedef void (*wlshm_band_proc)(void *arg, int band, int bands);
+
+/* Worker threads for splitting large copies, see wlshm_threads.c */
+struct wlshm_threads {
+    int			count;
+    pthread_t		*threads;
+    pthread_mutex_t	lock;
+    pthread_cond_t	work_cond;
+    pthread_cond_t	done_cond;
+    unsigned int	generation;
+    Bool		quit;
+
+    wlshm_band_proc	func;
+    void		*arg;
+    int			bands;
+    int			next_band;
+    int			bands_done;
+};
+
+/* Row alignment of back buffers, one cache line */
+#define WLSHM_STRIDE_ALIGN	64
+
+/* Buffers from this size up are backed by huge pages if possible */
+#define WLSHM_HUGE_THRESHOLD	(4 << 20)
+
+enum wlshm_huge {
+    WLSHM_HUGE_NONE,
+    WLSHM_HUGE_THP,	/* madvise(MADV_HUGEPAGE) accepted */
+};
+
+/* A memfd and its mapping, recycled through struct wlshm_pool */
+struct wlshm_buffer {
+    struct xorg_list	class_link;
+    struct xorg_list	lru_link;
+    int			fd;
+    void		*data;
+    size_t		size;
+    int			size_class;
+    CARD32		freed;
+    enum wlshm_huge	huge;
+};
+
+#define WLSHM_DEFAULT_THREADS	3
+
+#define WLSHM_RETAIN_DEFAULT_LIMIT	(64 << 20)
+
+#define WLSHM_DAMAGE_DEFAULT_MAX_RECTS	16
+#define WLSHM_DAMAGE_DEFAULT_RECT_COST	4096
+
+#define WLSHM_POOL_NUM_CLASSES	64
+#define WLSHM_POOL_DEFAULT_LIMIT	(64 << 20)
+
+/*
+ * The driver never sees wl_buffer.release, and compositors keep showing
+ * the last buffer of a surface that just went away, for unmap
+ * animations.  A freed buffer therefore sits out this long before it is
+ * handed to another window, which would otherwise show up in its place,
+ * and a retained one before its pages are given back.
+ */
+#define WLSHM_POOL_GRACE_MS	1000
+
+/* Most the prep thread keeps populated ahead of time, by default */
+#define WLSHM_PREP_LIMIT	(64 << 20)
+
+struct wlshm_pool {
+    ScrnInfoPtr		pScrn;
+    struct xorg_list	free[WLSHM_POOL_NUM_CLASSES];
+    struct xorg_list	lru;
+    size_t		free_bytes;
+    size_t		limit;
+    Bool		huge_pages;
+
+    unsigned long	buffers_created;
+    unsigned long	buffers_destroyed;
+    unsigned long	huge_buffers_created;
+    size_t		mapped_bytes;
+
+    /* Buffers populated ahead of time by the prep thread */
+    Bool		prep_running;
+    pthread_t		prep_thread;
+    pthread_mutex_t	prep_lock;
+    pthread_cond_t	prep_cond;
+    Bool		prep_quit;
+    int			prep_want[WLSHM_POOL_NUM_CLASSES];
+    struct xorg_list	prep_ready[WLSHM_POOL_NUM_CLASSES];
+    size_t		prep_bytes;
+    size_t		prep_limit;
+    unsigned long	prep_hits;
+};
+
+/* Latency histograms, bucket n counts events under 2^n us */
+#define WLSHM_STATS_BUCKETS	16
+
+/* Performance counters, dumped to the log on SIGUSR1 */
+struct wlshm_stats {
+    /* Window buffers attached to and detached from window pixmaps */
+    uint64_t	attached;
+    uint64_t	detached;
+    uint64_t	attached_bytes;
+    uint64_t	retain_hits;
+    uint64_t	retain_evictions;
+
+    /* Retained buffers released under the memory budget */
+    uint64_t	releases;
+    uint64_t	compressions;
+    uint64_t	decompressions;
+    uint64_t	decompress_usec;
+    uint64_t	decompress_max_usec;
+
+    /* Bytes copied into shm on attach, back out on detach, on commit */
+    uint64_t	copy_in_bytes;
+    uint64_t	copy_out_bytes;
+    uint64_t	copy_commit_bytes;
+    /* Bytes a full copy back would have moved but damage tracking didn't */
+    uint64_t	copy_saved_bytes;
+    uint64_t	tile_pixels_suppressed;
+
+    /* Damage rectangles before and after simplification, area added */
+    uint64_t	damage_rects_in;
+    uint64_t	damage_rects_out;
+    uint64_t	damage_overdraw;
+
+    uint64_t	flushes;
+    uint64_t	commits;
+    uint64_t	commits_coalesced;
+
+    uint64_t	composites_banded;
+    uint64_t	video_frames;
+
+    uint32_t	create_usec[WLSHM_STATS_BUCKETS];
+    /* From wlshm_create_window_buffer() to the first commit after it */
+    uint32_t	first_frame_usec[WLSHM_STATS_BUCKETS];
+};
 
 /* globals */
 struct wlshm_device
@@ -30,17 +170,98 @@ struct wlshm_device
     DestroyWindowProcPtr DestroyWindow;
     UnrealizeWindowProcPtr UnrealizeWindow;
     SetWindowPixmapProcPtr SetWindowPixmap;
+    CompositeProcPtr Composite;
+    CreateGCProcPtr CreateGC;
+    XF86VideoAdaptorPtr video_adaptor;
 
     pointer* fb;
+    size_t fb_size;
+    Bool huge_pages;
+    Bool prefault;
+    Bool sw_cursor;
+
+    struct wlshm_pool pool;
+    size_t pool_limit;
+    struct wlshm_threads threads;
+    int num_threads;
+    Bool back_buffer;
+    Bool convert_depth30;
+    Bool tile_filter;
+    int damage_max_rects;
+    int damage_rect_cost;
+
+    /* struct wlshm_pixmap currently attached to a window */
+    struct xorg_list pixmaps;
+
+    /* struct wlshm_pixmap of unmapped windows, most recent first */
+    struct xorg_list retained;
+    size_t retained_bytes;
+    size_t retain_limit;
+
+    /* Cap on resident shm, 0 for none; see wlshm_budget.c */
+    size_t budget;
+    size_t released_bytes;
+    size_t compressed_bytes;
+    /* Comes back for retained buffers still in their grace period */
+    OsTimerPtr budget_timer;
+
+    /* Commit pacing, see wlshm_flush_callback() */
+    CARD32 commit_interval;
+    CARD32 last_commit;
+    OsTimerPtr commit_timer;
+    Bool commit_pending;
+
+    struct wlshm_stats stats;
+    int stats_seen;
 
     struct xwl_screen *xwl_screen;
 };
 
 struct wlshm_pixmap {
-    int fd;
+    struct xorg_list link;
+    PixmapPtr pixmap;
+    struct wlshm_buffer *buffer;
     void *orig;
+    int orig_stride;
     void *data;
+    int stride;
     size_t bytes;
+
+    /* Drawn to since attach, or since the last commit if back buffered */
+    DamagePtr damage;
+
+    /* Damage since the last commit and the window it is posted for */
+    DamagePtr frame_damage;
+    WindowPtr window;
+
+    /* X renders into orig, damage is copied to data on flush */
+    Bool back_buffered;
+    /* Cache line aligned copy of orig that X renders into instead */
+    void *back;
+    /* Drawn to since attach, what back has that orig doesn't */
+    DamagePtr back_damage;
+    /* Depth 30 back buffer, converted into an 8 bit shm buffer */
+    Bool convert;
+
+    /* Window unmapped, buffer kept on wlshm_device.retained */
+    Bool retained;
+    CARD32 retained_since;
+
+    /* Hash of each tile of what is in shm, see wlshm_tiles.c */
+    uint64_t *tile_hash;
+    int *tile_todo;
+    int tiles_x, tiles_y;
+
+    /* Retained and over budget: shm pages given back, see wlshm_budget.c */
+    Bool released;
+    void *compressed;
+    size_t compressed_size;
+
+    CARD32 attach_time;
+    struct timespec create_start;
+    Bool first_frame_pending;
+    uint64_t copy_bytes;
+    uint64_t commits;
 };
 
 static inline struct wlshm_device *wlshm_scrninfo_priv(ScrnInfoPtr pScrn)
@@ -53,4 +274,127 @@ static inline struct wlshm_device *wlshm_screen_priv(ScreenPtr pScreen)
     return wlshm_scrninfo_priv(xf86Screens[pScreen->myNum]);
 }
 
+/* wlshm.c */
+struct wlshm_pixmap *wlshm_get_pixmap(PixmapPtr pixmap);
+
+/* wlshm_budget.c */
+void wlshm_budget_enforce(struct wlshm_device *wlshm);
+void wlshm_budget_restore(struct wlshm_device *wlshm, struct wlshm_pixmap *d);
+void wlshm_budget_unpack(struct wlshm_device *wlshm, struct wlshm_pixmap *d,
+                         void *dst, int dst_stride);
+void wlshm_budget_forget(struct wlshm_device *wlshm, struct wlshm_pixmap *d);
+
+/* wlshm_damage.c */
+uint64_t wlshm_region_area(RegionPtr region);
+Bool wlshm_damage_reduce(RegionPtr damage, RegionPtr out,
+                         int max_rects, int rect_cost, uint64_t *overdraw);
+
+/* wlshm_convert.c */
+void wlshm_convert_init(void);
+const char *wlshm_convert_kernel_name(void);
+void wlshm_convert_rect(struct wlshm_threads *threads,
+                        void *dst, int dst_stride,
+                        const void *src, int src_stride,
+                        int width, int height);
+
+/* wlshm_copy.c */
+void wlshm_copy_init(void);
+const char *wlshm_copy_kernel_name(void);
+void wlshm_copy_rect(struct wlshm_threads *threads,
+                     void *dst, int dst_stride, const void *src, int src_stride,
+                     int width, int height, Bool to_shm);
+
+/* wlshm_pool.c */
+void wlshm_pool_init(struct wlshm_pool *pool, ScrnInfoPtr pScrn, size_t limit,
+                     Bool huge_pages, size_t prep_limit);
+void wlshm_pool_fini(struct wlshm_pool *pool);
+struct wlshm_buffer *wlshm_pool_get(struct wlshm_pool *pool, size_t size);
+void wlshm_pool_expect(struct wlshm_pool *pool, size_t size);
+void wlshm_pool_put(struct wlshm_pool *pool, struct wlshm_buffer *buffer);
+void wlshm_pool_trim(struct wlshm_pool *pool, size_t limit);
+size_t wlshm_pool_prep_bytes(struct wlshm_pool *pool);
+void wlshm_pool_drop_prep(struct wlshm_pool *pool, size_t limit);
+
+/* A Render composite cut into bands, see wlshm_raster.c */
+struct wlshm_composite_images {
+    pixman_image_t *src, *mask, *dest;
+};
+
+struct wlshm_composite_job {
+    pixman_op_t op;
+    /* One set per band */
+    struct wlshm_composite_images *images;
+    int src_x, src_y;
+    int mask_x, mask_y;
+    int dest_x, dest_y;
+    int width, height;
+};
+
+/* wlshm_raster.c */
+int wlshm_raster_bands(struct wlshm_threads *threads, int64_t pixels,
+                       int height);
+void wlshm_raster_composite(struct wlshm_threads *threads,
+                            struct wlshm_composite_job *job, int bands);
+void wlshm_raster_fill(struct wlshm_threads *threads, uint32_t *bits,
+                       int stride, int bpp, const BoxRec *boxes, int nbox,
+                       int x_off, int y_off, uint32_t pixel);
+
+/* wlshm_render.c */
+void wlshm_render_init(ScreenPtr pScreen);
+void wlshm_render_fini(ScreenPtr pScreen);
+
+/* wlshm_stats.c */
+void wlshm_stats_init(ScrnInfoPtr pScrn);
+void wlshm_stats_fini(ScrnInfoPtr pScrn);
+void wlshm_stats_dump(ScrnInfoPtr pScrn, int verb);
+void wlshm_stats_record_latency(uint32_t *buckets, long usec);
+
+/* wlshm_tiles.c */
+void wlshm_tiles_init(void);
+const char *wlshm_tiles_kernel_name(void);
+Bool wlshm_tiles_attach(struct wlshm_pixmap *d);
+void wlshm_tiles_detach(struct wlshm_pixmap *d);
+uint64_t wlshm_tiles_filter(struct wlshm_threads *threads,
+                            struct wlshm_pixmap *d, RegionPtr damage);
+
+/* wlshm_video.c */
+void wlshm_video_screen_init(ScreenPtr pScreen);
+void wlshm_video_screen_fini(ScreenPtr pScreen);
+
+/* Source layouts of an Xv image, see wlshm_yuv.c */
+enum wlshm_yuv_format {
+    WLSHM_YUV_YUY2,	/* Packed 4:2:2 */
+    WLSHM_YUV_PLANAR,	/* YV12 and I420, with planes in Y, U, V order */
+    WLSHM_YUV_NV12,	/* Y plane, then interleaved U and V */
+};
+
+/* Conversion of a box of an Xv image into an x8r8g8b8 destination */
+struct wlshm_yuv_job {
+    enum wlshm_yuv_format format;
+    const uint8_t *planes[3];	/* Y, U, V; NV12 and YUY2 only use some */
+    int pitches[3];
+
+    /* Source position of destination pixel (x, y), in 16.16 fixed point */
+    int sx0, sy0, sx_step, sy_step;
+    int drw_x, drw_y;
+
+    uint8_t *dst;
+    int dst_stride;
+    BoxRec box;
+};
+
+/* wlshm_yuv.c */
+void wlshm_yuv_init(void);
+const char *wlshm_yuv_kernel_name(void);
+const char *wlshm_yuv_use_kernel(int n);
+void wlshm_yuv_band(void *arg, int band, int bands);
+
+/* wlshm_threads.c */
+Bool wlshm_threads_init(struct wlshm_threads *threads, ScrnInfoPtr pScrn,
+                        int count);
+void wlshm_threads_fini(struct wlshm_threads *threads);
+void wlshm_threads_run(struct wlshm_threads *threads, int bands,
+                       wlshm_band_proc func, void *arg);
+void wlshm_threads_block_signals(sigset_t *old);
+
 #endif
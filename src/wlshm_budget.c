@@ -0,0 +1,276 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <time.h>
+#endif
+
+/*
+ * With many servers per host, the shm of windows nobody looks at adds
+ * up.  The MemoryBudget option caps the shm the driver keeps resident.
+ * Past it, buffers populated ahead of time by the prep thread go first,
+ * then idle pool buffers, then the buffers of unmapped
+ * windows are given back to the kernel, least recently unmapped first,
+ * and brought back when the window is mapped again.  A window unmapped
+ * less than WLSHM_POOL_GRACE_MS ago may still be on screen in the
+ * compositor's unmap animation, so its pages stay until a timer comes
+ * back for them.
+ *
+ * An unmapped window can't be drawn to or read from, its clip list is
+ * empty, so its pixmap is left pointing at the released pages.
+ *
+ * A back buffered pixmap still has its contents in system memory and
+ * the shm pages are just dropped.  Otherwise shm is the only copy, so
+ * it is compressed first, which needs lz4.
+ */
+
+static size_t
+wlshm_budget_resident(struct wlshm_device *wlshm)
+{
+    return wlshm->pool.mapped_bytes - wlshm->released_bytes +
+        wlshm->compressed_bytes + wlshm_pool_prep_bytes(&wlshm->pool);
+}
+
+static Bool
+wlshm_buffer_release(struct wlshm_buffer *buffer)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(buffer->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  0, buffer->size) == 0)
+        return TRUE;
+#endif
+#ifdef MADV_REMOVE
+    if (madvise(buffer->data, buffer->size, MADV_REMOVE) == 0)
+        return TRUE;
+#endif
+    return FALSE;
+}
+
+#ifdef HAVE_LZ4
+static Bool
+wlshm_budget_compress(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    int bound, size;
+    char *dst;
+
+    if (d->bytes > LZ4_MAX_INPUT_SIZE)
+        return FALSE;
+
+    bound = LZ4_compressBound(d->bytes);
+    dst = malloc(bound);
+    if (!dst)
+        return FALSE;
+
+    size = LZ4_compress_default(d->data, dst, d->bytes, bound);
+    if (size <= 0 || (size_t)size >= d->bytes / 2) {
+        /* Not worth it, leave this one resident */
+        free(dst);
+        return FALSE;
+    }
+
+    d->compressed = realloc(dst, size);
+    if (!d->compressed)
+        d->compressed = dst;
+    d->compressed_size = size;
+    wlshm->compressed_bytes += size;
+    wlshm->stats.compressions++;
+
+    return TRUE;
+}
+#endif
+
+static Bool
+wlshm_budget_release(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    if (!d->back_buffered) {
+#ifdef HAVE_LZ4
+        if (!wlshm_budget_compress(wlshm, d))
+            return FALSE;
+#else
+        return FALSE;
+#endif
+    }
+
+    if (!wlshm_buffer_release(d->buffer)) {
+        wlshm_budget_forget(wlshm, d);
+        return FALSE;
+    }
+
+    d->released = TRUE;
+    wlshm->released_bytes += d->buffer->size;
+    wlshm->stats.releases++;
+
+    return TRUE;
+}
+
+static CARD32
+wlshm_budget_timer(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+    wlshm_budget_enforce(arg);
+
+    return 0;
+}
+
+void
+wlshm_budget_enforce(struct wlshm_device *wlshm)
+{
+    struct xorg_list *link, *prev;
+    struct wlshm_pixmap *d;
+    size_t resident, prep;
+    CARD32 now;
+
+    if (!wlshm->budget)
+        return;
+
+    resident = wlshm_budget_resident(wlshm);
+    if (resident <= wlshm->budget)
+        return;
+
+    prep = wlshm_pool_prep_bytes(&wlshm->pool);
+    if (resident - wlshm->budget < prep)
+        wlshm_pool_drop_prep(&wlshm->pool, prep - (resident - wlshm->budget));
+    else
+        wlshm_pool_drop_prep(&wlshm->pool, 0);
+
+    resident = wlshm_budget_resident(wlshm);
+    if (resident <= wlshm->budget)
+        return;
+
+    if (resident - wlshm->budget < wlshm->pool.free_bytes)
+        wlshm_pool_trim(&wlshm->pool,
+                        wlshm->pool.free_bytes - (resident - wlshm->budget));
+    else
+        wlshm_pool_trim(&wlshm->pool, 0);
+
+    now = GetTimeInMillis();
+    for (link = wlshm->retained.prev;
+         link != &wlshm->retained &&
+             wlshm_budget_resident(wlshm) > wlshm->budget;
+         link = prev) {
+        prev = link->prev;
+        d = xorg_list_entry(link, struct wlshm_pixmap, link);
+        if (d->released)
+            continue;
+
+        /* Everything after this one was unmapped later still */
+        if (now - d->retained_since < WLSHM_POOL_GRACE_MS) {
+            wlshm->budget_timer =
+                TimerSet(wlshm->budget_timer, 0,
+                         WLSHM_POOL_GRACE_MS - (now - d->retained_since),
+                         wlshm_budget_timer, wlshm);
+            break;
+        }
+
+        wlshm_budget_release(wlshm, d);
+    }
+}
+
+#ifdef HAVE_LZ4
+/* Decompress into rows of dst_stride bytes */
+static void
+wlshm_budget_decompress(struct wlshm_device *wlshm, struct wlshm_pixmap *d,
+                        void *dst, int dst_stride)
+{
+    ScrnInfoPtr pScrn = xf86Screens[d->pixmap->drawable.pScreen->myNum];
+    struct timespec start, end;
+    void *tmp = NULL;
+    uint64_t usec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (dst_stride != d->stride) {
+        tmp = malloc(d->bytes);
+        if (!tmp) {
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "can't allocate %lu bytes to decompress into\n",
+                       (unsigned long)d->bytes);
+            return;
+        }
+    }
+
+    if (LZ4_decompress_safe(d->compressed, tmp ? tmp : dst,
+                            d->compressed_size, d->bytes) != (int)d->bytes)
+        xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                   "can't decompress %lu byte window buffer\n",
+                   (unsigned long)d->bytes);
+    else if (tmp)
+        wlshm_copy_rect(&wlshm->threads, dst, dst_stride, tmp, d->stride,
+                        d->stride, d->pixmap->drawable.height, FALSE);
+    free(tmp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    usec = (end.tv_sec - start.tv_sec) * 1000000 +
+        (end.tv_nsec - start.tv_nsec) / 1000;
+    wlshm->stats.decompressions++;
+    wlshm->stats.decompress_usec += usec;
+    if (usec > wlshm->stats.decompress_max_usec)
+        wlshm->stats.decompress_max_usec = usec;
+}
+#endif
+
+/* Make a released buffer hold the pixmap's contents again */
+void
+wlshm_budget_restore(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    PixmapPtr pixmap = d->pixmap;
+
+    if (!d->released)
+        return;
+
+    if (d->convert) {
+        wlshm_convert_rect(&wlshm->threads,
+                           d->data, d->stride,
+                           pixmap->devPrivate.ptr, pixmap->devKind,
+                           pixmap->drawable.width, pixmap->drawable.height);
+        wlshm->stats.copy_in_bytes += d->bytes;
+    } else if (d->back_buffered) {
+        wlshm_copy_rect(&wlshm->threads,
+                        d->data, d->stride,
+                        pixmap->devPrivate.ptr, pixmap->devKind,
+                        d->stride, pixmap->drawable.height, TRUE);
+        wlshm->stats.copy_in_bytes += d->bytes;
+    }
+#ifdef HAVE_LZ4
+    else
+        wlshm_budget_decompress(wlshm, d, d->data, d->stride);
+#endif
+
+    wlshm_budget_forget(wlshm, d);
+}
+
+/*
+ * Copy the contents of a released buffer that isn't back buffered to
+ * dst, without bringing its pages back, for a pixmap being detached.
+ */
+void
+wlshm_budget_unpack(struct wlshm_device *wlshm, struct wlshm_pixmap *d,
+                    void *dst, int dst_stride)
+{
+#ifdef HAVE_LZ4
+    if (d->released && d->compressed)
+        wlshm_budget_decompress(wlshm, d, dst, dst_stride);
+#endif
+}
+
+/* Forget a pixmap's released pages and compressed copy, if any */
+void
+wlshm_budget_forget(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    if (d->released) {
+        d->released = FALSE;
+        wlshm->released_bytes -= d->buffer->size;
+    }
+
+    if (d->compressed) {
+        wlshm->compressed_bytes -= d->compressed_size;
+        free(d->compressed);
+        d->compressed = NULL;
+        d->compressed_size = 0;
+    }
+}
@@ -0,0 +1,168 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define WLSHM_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Depth 30 window buffers.  X renders x2r10g10b10 into the back buffer,
+ * but xwayland only ever tells the compositor a buffer is XRGB8888, and
+ * 2101010 is optional in wl_shm anyway.  So with ConvertDepth30 the
+ * damage is converted on its way into shm instead of copied, keeping
+ * the top 8 bits of each channel:
+ *
+ *   r = p >> 22, g = p >> 12, b = p >> 2
+ *
+ * which, shifted into place, is three shifts and masks per pixel.
+ */
+
+/* Conversions smaller than this aren't worth waking other threads for */
+#define WLSHM_CONVERT_THREAD_PIXELS	(512 * 1024)
+#define WLSHM_CONVERT_THREAD_MIN_ROWS	16
+
+typedef void (*wlshm_convert_row_proc)(uint32_t *dst, const uint32_t *src,
+                                       int width);
+
+static inline uint32_t
+wlshm_convert_pixel(uint32_t p)
+{
+    return ((p >> 6) & 0xff0000) | ((p >> 4) & 0xff00) | ((p >> 2) & 0xff);
+}
+
+static void
+wlshm_convert_row_c(uint32_t *dst, const uint32_t *src, int width)
+{
+    while (width--)
+        *dst++ = wlshm_convert_pixel(*src++);
+}
+
+#ifdef WLSHM_CONVERT_X86
+
+__attribute__((target("sse2")))
+static void
+wlshm_convert_row_sse2(uint32_t *dst, const uint32_t *src, int width)
+{
+    const __m128i r_mask = _mm_set1_epi32(0xff0000);
+    const __m128i g_mask = _mm_set1_epi32(0xff00);
+    const __m128i b_mask = _mm_set1_epi32(0xff);
+
+    for (; width >= 4; width -= 4, dst += 4, src += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)src);
+        __m128i r = _mm_and_si128(_mm_srli_epi32(p, 6), r_mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(p, 4), g_mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(p, 2), b_mask);
+
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_or_si128(_mm_or_si128(r, g), b));
+    }
+
+    wlshm_convert_row_c(dst, src, width);
+}
+
+__attribute__((target("avx2")))
+static void
+wlshm_convert_row_avx2(uint32_t *dst, const uint32_t *src, int width)
+{
+    const __m256i r_mask = _mm256_set1_epi32(0xff0000);
+    const __m256i g_mask = _mm256_set1_epi32(0xff00);
+    const __m256i b_mask = _mm256_set1_epi32(0xff);
+
+    for (; width >= 8; width -= 8, dst += 8, src += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)src);
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 6), r_mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 4), g_mask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 2), b_mask);
+
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_or_si256(_mm256_or_si256(r, g), b));
+    }
+
+    wlshm_convert_row_c(dst, src, width);
+}
+
+#endif /* WLSHM_CONVERT_X86 */
+
+static wlshm_convert_row_proc wlshm_convert_row = wlshm_convert_row_c;
+static const char *wlshm_convert_name = "C";
+
+void
+wlshm_convert_init(void)
+{
+#ifdef WLSHM_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        wlshm_convert_row = wlshm_convert_row_avx2;
+        wlshm_convert_name = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        wlshm_convert_row = wlshm_convert_row_sse2;
+        wlshm_convert_name = "SSE2";
+    }
+#endif
+}
+
+const char *
+wlshm_convert_kernel_name(void)
+{
+    return wlshm_convert_name;
+}
+
+struct wlshm_convert_job {
+    uint8_t *dst;
+    int dst_stride;
+    const uint8_t *src;
+    int src_stride;
+    int width;
+    int height;
+};
+
+static void
+wlshm_convert_band(void *arg, int band, int bands)
+{
+    struct wlshm_convert_job *job = arg;
+    int y = job->height * band / bands;
+    int y2 = job->height * (band + 1) / bands;
+    uint8_t *dst = job->dst + (size_t)y * job->dst_stride;
+    const uint8_t *src = job->src + (size_t)y * job->src_stride;
+
+    for (; y < y2; y++) {
+        wlshm_convert_row((uint32_t *)dst, (const uint32_t *)src, job->width);
+        dst += job->dst_stride;
+        src += job->src_stride;
+    }
+}
+
+/*
+ * Convert a height x width (in pixels) block of x2r10g10b10 into
+ * x8r8g8b8, split into bands of rows across threads if it's large.
+ */
+void
+wlshm_convert_rect(struct wlshm_threads *threads,
+                   void *dst, int dst_stride, const void *src, int src_stride,
+                   int width, int height)
+{
+    struct wlshm_convert_job job;
+    int bands = 1;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    job.dst = dst;
+    job.dst_stride = dst_stride;
+    job.src = src;
+    job.src_stride = src_stride;
+    job.width = width;
+    job.height = height;
+
+    if (threads && threads->count > 0 &&
+        (size_t)width * height >= WLSHM_CONVERT_THREAD_PIXELS) {
+        bands = min(threads->count + 1,
+                    height / WLSHM_CONVERT_THREAD_MIN_ROWS);
+    }
+
+    wlshm_threads_run(threads, max(bands, 1), wlshm_convert_band, &job);
+}
@@ -0,0 +1,222 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define WLSHM_COPY_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Row copies between window pixmaps and shm buffers.
+ *
+ * Small copies go through memcpy, which is already as good as it gets
+ * while the data stays in cache.  Large copies into shm are different:
+ * the compositor is the next one to read those pixels, so writing them
+ * through the cache only evicts the X server's own working set.  For
+ * those we use non-temporal stores, with the widest variant the CPU
+ * supports picked once at module load.
+ */
+
+/* Copies smaller than this stay in the cache */
+#define WLSHM_STREAM_THRESHOLD	(512 * 1024)
+
+/* Copies smaller than this aren't worth waking other threads for */
+#define WLSHM_THREAD_THRESHOLD	(2 * 1024 * 1024)
+#define WLSHM_THREAD_MIN_ROWS	16
+
+typedef void (*wlshm_stream_rows_proc)(uint8_t *dst, int dst_stride,
+                                       const uint8_t *src, int src_stride,
+                                       int width, int height);
+
+static void
+wlshm_copy_rows_c(uint8_t *dst, int dst_stride,
+                  const uint8_t *src, int src_stride,
+                  int width, int height)
+{
+    if (dst_stride == width && src_stride == width) {
+        memcpy(dst, src, (size_t)width * height);
+        return;
+    }
+
+    while (height--) {
+        memcpy(dst, src, width);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+#ifdef WLSHM_COPY_X86
+
+__attribute__((target("sse2")))
+static void
+wlshm_stream_rows_sse2(uint8_t *dst, int dst_stride,
+                       const uint8_t *src, int src_stride,
+                       int width, int height)
+{
+    while (height--) {
+        uint8_t *d = dst;
+        const uint8_t *s = src;
+        int n = width;
+        int head = (-(uintptr_t)d) & 15;
+
+        if (head > n)
+            head = n;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 64; n -= 64, d += 64, s += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(s + 0));
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+            _mm_stream_si128((__m128i *)(d + 0), a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        }
+        for (; n >= 16; n -= 16, d += 16, s += 16)
+            _mm_stream_si128((__m128i *)d,
+                             _mm_loadu_si128((const __m128i *)s));
+        memcpy(d, s, n);
+
+        dst += dst_stride;
+        src += src_stride;
+    }
+
+    _mm_sfence();
+}
+
+__attribute__((target("avx2")))
+static void
+wlshm_stream_rows_avx2(uint8_t *dst, int dst_stride,
+                       const uint8_t *src, int src_stride,
+                       int width, int height)
+{
+    while (height--) {
+        uint8_t *d = dst;
+        const uint8_t *s = src;
+        int n = width;
+        int head = (-(uintptr_t)d) & 31;
+
+        if (head > n)
+            head = n;
+        memcpy(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+
+        for (; n >= 128; n -= 128, d += 128, s += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(s + 0));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+
+            _mm256_stream_si256((__m256i *)(d + 0), a);
+            _mm256_stream_si256((__m256i *)(d + 32), b);
+            _mm256_stream_si256((__m256i *)(d + 64), c);
+            _mm256_stream_si256((__m256i *)(d + 96), e);
+        }
+        for (; n >= 32; n -= 32, d += 32, s += 32)
+            _mm256_stream_si256((__m256i *)d,
+                                _mm256_loadu_si256((const __m256i *)s));
+        memcpy(d, s, n);
+
+        dst += dst_stride;
+        src += src_stride;
+    }
+
+    _mm_sfence();
+}
+
+#endif /* WLSHM_COPY_X86 */
+
+static wlshm_stream_rows_proc wlshm_stream_rows = wlshm_copy_rows_c;
+static const char *wlshm_stream_name = "C";
+
+void
+wlshm_copy_init(void)
+{
+#ifdef WLSHM_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        wlshm_stream_rows = wlshm_stream_rows_avx2;
+        wlshm_stream_name = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        wlshm_stream_rows = wlshm_stream_rows_sse2;
+        wlshm_stream_name = "SSE2";
+    }
+#endif
+}
+
+const char *
+wlshm_copy_kernel_name(void)
+{
+    return wlshm_stream_name;
+}
+
+struct wlshm_copy_job {
+    uint8_t *dst;
+    int dst_stride;
+    const uint8_t *src;
+    int src_stride;
+    int width;
+    int height;
+    Bool stream;
+};
+
+static void
+wlshm_copy_band(void *arg, int band, int bands)
+{
+    struct wlshm_copy_job *job = arg;
+    int y1 = job->height * band / bands;
+    int y2 = job->height * (band + 1) / bands;
+    uint8_t *dst = job->dst + (size_t)y1 * job->dst_stride;
+    const uint8_t *src = job->src + (size_t)y1 * job->src_stride;
+
+    if (job->stream)
+        wlshm_stream_rows(dst, job->dst_stride, src, job->src_stride,
+                          job->width, y2 - y1);
+    else
+        wlshm_copy_rows_c(dst, job->dst_stride, src, job->src_stride,
+                          job->width, y2 - y1);
+}
+
+/*
+ * Copy a height x width (in bytes) block.  to_shm says the destination
+ * is a buffer shared with the compositor.  Large blocks are split into
+ * bands of rows across threads, if any.
+ */
+void
+wlshm_copy_rect(struct wlshm_threads *threads,
+                void *dst, int dst_stride, const void *src, int src_stride,
+                int width, int height, Bool to_shm)
+{
+    struct wlshm_copy_job job;
+    size_t bytes = (size_t)width * height;
+    int bands = 1;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    job.dst = dst;
+    job.dst_stride = dst_stride;
+    job.src = src;
+    job.src_stride = src_stride;
+    job.width = width;
+    job.height = height;
+    job.stream = to_shm && bytes >= WLSHM_STREAM_THRESHOLD;
+
+    if (threads && threads->count > 0 && bytes >= WLSHM_THREAD_THRESHOLD) {
+        bands = threads->count + 1;
+        if (bands > height / WLSHM_THREAD_MIN_ROWS)
+            bands = height / WLSHM_THREAD_MIN_ROWS;
+    }
+
+    wlshm_threads_run(threads, bands > 1 ? bands : 1, wlshm_copy_band, &job);
+}
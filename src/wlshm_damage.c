@@ -0,0 +1,200 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+/*
+ * Text and small widgets leave damage in hundreds of little rectangles,
+ * and the compositor pays for every one of them.  Before a commit, the
+ * damage of each window is grown into a simpler region covering it: two
+ * boxes are merged into their bounding box while the area that adds
+ * costs less than keeping a rectangle (rect_cost pixels), or while there
+ * are more than max_rects left.  The cheapest partner of every box is
+ * cached, which keeps a typical reduction quadratic instead of cubic.
+ * Past WLSHM_DAMAGE_GREEDY_MAX boxes the pairwise search costs more
+ * than it saves and the bounding box is used.
+ */
+
+#define WLSHM_DAMAGE_GREEDY_MAX	128
+
+static inline int64_t
+wlshm_box_area(const BoxRec *box)
+{
+    return (int64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+uint64_t
+wlshm_region_area(RegionPtr region)
+{
+    BoxPtr box = RegionRects(region);
+    int n = RegionNumRects(region);
+    uint64_t area = 0;
+
+    while (n--)
+        area += wlshm_box_area(box++);
+
+    return area;
+}
+
+static inline void
+wlshm_box_union(BoxRec *dst, const BoxRec *a, const BoxRec *b)
+{
+    dst->x1 = min(a->x1, b->x1);
+    dst->y1 = min(a->y1, b->y1);
+    dst->x2 = max(a->x2, b->x2);
+    dst->y2 = max(a->y2, b->y2);
+}
+
+static inline int64_t
+wlshm_merge_cost(const BoxRec *a, const BoxRec *b)
+{
+    BoxRec merged;
+
+    wlshm_box_union(&merged, a, b);
+    return wlshm_box_area(&merged) - wlshm_box_area(a) - wlshm_box_area(b);
+}
+
+/* Find the box that is cheapest to merge boxes[i] with */
+static void
+wlshm_damage_partner(const BoxRec *boxes, int n, int i,
+                     int *partner, int64_t *cost)
+{
+    int64_t c;
+    int j;
+
+    partner[i] = -1;
+    cost[i] = INT64_MAX;
+    for (j = 0; j < n; j++) {
+        if (j == i)
+            continue;
+        c = wlshm_merge_cost(&boxes[i], &boxes[j]);
+        if (c < cost[i]) {
+            cost[i] = c;
+            partner[i] = j;
+        }
+    }
+}
+
+/*
+ * Fill out with a region covering damage, made of fewer rectangles if
+ * that's worth it.  Returns FALSE, leaving out alone, if damage is best
+ * left as it is.
+ */
+Bool
+wlshm_damage_reduce(RegionPtr damage, RegionPtr out,
+                    int max_rects, int rect_cost, uint64_t *overdraw)
+{
+    int n = RegionNumRects(damage);
+    int64_t *cost, c;
+    uint64_t area;
+    BoxRec *boxes;
+    RegionRec tmp;
+    int *partner;
+    int i, j, k;
+
+    if (n <= 1)
+        return FALSE;
+
+    area = wlshm_region_area(damage);
+
+    if (n > WLSHM_DAMAGE_GREEDY_MAX) {
+        RegionInit(out, RegionExtents(damage), 1);
+        *overdraw += wlshm_box_area(RegionExtents(damage)) - area;
+        return TRUE;
+    }
+
+    boxes = malloc(n * sizeof(*boxes));
+    partner = malloc(n * sizeof(*partner));
+    cost = malloc(n * sizeof(*cost));
+    if (!boxes || !partner || !cost) {
+        free(boxes);
+        free(partner);
+        free(cost);
+        return FALSE;
+    }
+    memcpy(boxes, RegionRects(damage), n * sizeof(*boxes));
+
+    /*
+     * Each box remembers its cheapest partner, so a merge only rescans
+     * the merged box and those whose partner went away, rather than every
+     * pair.  Merged boxes may overlap others, which makes the cost an
+     * estimate; that is all it needs to be.
+     */
+    for (i = 0; i < n; i++)
+        wlshm_damage_partner(boxes, n, i, partner, cost);
+
+    while (n > 1) {
+        i = 0;
+        for (k = 1; k < n; k++) {
+            if (cost[k] < cost[i])
+                i = k;
+        }
+
+        if (n <= max_rects && cost[i] >= rect_cost)
+            break;
+
+        j = partner[i];
+        if (j < i) {
+            k = i;
+            i = j;
+            j = k;
+        }
+
+        for (k = 0; k < n; k++) {
+            if (partner[k] == i || partner[k] == j)
+                partner[k] = -1;
+        }
+
+        /* Merge j into i and move the last box into j's place */
+        wlshm_box_union(&boxes[i], &boxes[i], &boxes[j]);
+        n--;
+        if (j != n) {
+            boxes[j] = boxes[n];
+            partner[j] = partner[n];
+            cost[j] = cost[n];
+        }
+
+        for (k = 0; k < n; k++) {
+            if (partner[k] == n)
+                partner[k] = j;
+            if (k == i || partner[k] < 0) {
+                wlshm_damage_partner(boxes, n, k, partner, cost);
+            } else {
+                c = wlshm_merge_cost(&boxes[k], &boxes[i]);
+                if (c < cost[k]) {
+                    cost[k] = c;
+                    partner[k] = i;
+                }
+            }
+        }
+    }
+    free(partner);
+    free(cost);
+
+    if (n == RegionNumRects(damage)) {
+        free(boxes);
+        return FALSE;
+    }
+
+    RegionNull(out);
+    for (i = 0; i < n; i++) {
+        RegionInit(&tmp, &boxes[i], 1);
+        RegionUnion(out, out, &tmp);
+        RegionUninit(&tmp);
+    }
+    free(boxes);
+
+    /* Overlapping boxes get split up again into bands */
+    if (RegionNumRects(out) > max_rects) {
+        RegionUninit(out);
+        RegionInit(out, RegionExtents(damage), 1);
+    } else if (RegionNumRects(out) >= RegionNumRects(damage)) {
+        RegionUninit(out);
+        return FALSE;
+    }
+
+    *overdraw += wlshm_region_area(out) - area;
+
+    return TRUE;
+}
@@ -0,0 +1,545 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+
+/*
+ * Window buffers are recycled rather than torn down, so short-lived
+ * windows (menus, tooltips) don't pay for a new file, an mmap and a
+ * fresh set of page faults every time they are mapped.
+ *
+ * xwayland wraps each buffer in its own wl_shm_pool at offset 0, so a
+ * buffer can't be carved out of a shared region; instead every buffer
+ * keeps its own memfd, rounded up to a size class so that windows of
+ * slightly different sizes can share it.  Classes are spaced four per
+ * power of two above WLSHM_POOL_MIN_CLASS, which bounds the waste to 25%.
+ */
+
+#define WLSHM_POOL_MIN_SHIFT	16
+#define WLSHM_POOL_MIN_CLASS	((size_t)1 << WLSHM_POOL_MIN_SHIFT)
+
+/*
+ * Create the file backing a window buffer.  An anonymous memfd is
+ * preferred: it never touches a filesystem and can be sealed against
+ * resizing, which tells the compositor it doesn't need to guard its
+ * mapping against SIGBUS.  Fall back to an unlinked file in /tmp on
+ * kernels without memfd_create.
+ */
+static int
+wlshm_create_shm_fd(ScrnInfoPtr pScrn, size_t size)
+{
+    char filename[] = "/tmp/wayland-shm-XXXXXX";
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("wlshm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0) {
+        if (ftruncate(fd, size) < 0) {
+            if (pScrn)
+                xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                           "ftruncate failed: %s\n", strerror(errno));
+            close(fd);
+            return -1;
+        }
+
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0 && pScrn)
+            xf86DrvMsgVerb(pScrn->scrnIndex, X_WARNING, 3,
+                           "can't seal shm buffer: %s\n", strerror(errno));
+
+        return fd;
+    }
+
+    if (pScrn)
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_WARNING, 3,
+                       "memfd_create failed: %s, falling back to %s\n",
+                       strerror(errno), filename);
+#endif
+
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        if (pScrn)
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "open %s failed: %s\n",
+                       filename, strerror(errno));
+        return -1;
+    }
+    unlink(filename);
+
+    if (ftruncate(fd, size) < 0) {
+        if (pScrn)
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "ftruncate failed: %s\n",
+                       strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+wlshm_pool_size_class(size_t size, size_t *class_size)
+{
+    size_t base, step, page;
+    int shift, n, size_class;
+
+    if (size <= WLSHM_POOL_MIN_CLASS) {
+        *class_size = WLSHM_POOL_MIN_CLASS;
+        return 0;
+    }
+
+    shift = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size - 1);
+    base = (size_t)1 << shift;
+    step = base / 4;
+    n = (size - base + step - 1) / step;
+
+    size_class = (shift - WLSHM_POOL_MIN_SHIFT) * 4 + n;
+    if (size_class >= WLSHM_POOL_NUM_CLASSES) {
+        /* Too big to be worth keeping around */
+        page = getpagesize();
+        *class_size = (size + page - 1) & ~(page - 1);
+        return -1;
+    }
+
+    *class_size = base + n * step;
+    return size_class;
+}
+
+/* The inverse of wlshm_pool_size_class() */
+static void
+wlshm_pool_class_size(int size_class, size_t *class_size)
+{
+    size_t base;
+
+    if (size_class == 0) {
+        *class_size = WLSHM_POOL_MIN_CLASS;
+        return;
+    }
+
+    base = (size_t)1 << ((size_class - 1) / 4 + WLSHM_POOL_MIN_SHIFT);
+    *class_size = base + ((size_class - 1) % 4 + 1) * (base / 4);
+}
+
+static void
+wlshm_buffer_destroy(struct wlshm_pool *pool, struct wlshm_buffer *buffer)
+{
+    pool->buffers_destroyed++;
+    pool->mapped_bytes -= buffer->size;
+    munmap(buffer->data, buffer->size);
+    close(buffer->fd);
+    free(buffer);
+}
+
+static void
+wlshm_pool_remove(struct wlshm_pool *pool, struct wlshm_buffer *buffer)
+{
+    xorg_list_del(&buffer->class_link);
+    xorg_list_del(&buffer->lru_link);
+    pool->free_bytes -= buffer->size;
+}
+
+/*
+ * Create a buffer of class_size bytes.  With populate, its pages are
+ * allocated and mapped up front instead of faulting in one by one on
+ * first write.  pScrn is NULL when called from the prep thread, which
+ * must not log.
+ */
+static struct wlshm_buffer *
+wlshm_buffer_create(ScrnInfoPtr pScrn, size_t class_size, int size_class,
+                    Bool huge_pages, Bool populate)
+{
+    struct wlshm_buffer *buffer;
+    int flags = MAP_SHARED;
+    int err;
+
+#ifdef MAP_POPULATE
+    if (populate)
+        flags |= MAP_POPULATE;
+#endif
+
+    buffer = calloc(sizeof (struct wlshm_buffer), 1);
+    if (!buffer) {
+        if (pScrn)
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                       "can't alloc wlshm buffer: %s\n", strerror(errno));
+        return NULL;
+    }
+    buffer->size = class_size;
+    buffer->size_class = size_class;
+    buffer->fd = -1;
+    buffer->data = MAP_FAILED;
+
+    buffer->fd = wlshm_create_shm_fd(pScrn, buffer->size);
+    if (buffer->fd < 0) {
+        free(buffer);
+        return NULL;
+    }
+
+    /*
+     * Allocate the pages themselves, so MAP_POPULATE only maps them.  If
+     * shm is short of them, the first copy into the buffer would take a
+     * SIGBUS instead.
+     */
+    if (populate) {
+        err = posix_fallocate(buffer->fd, 0, buffer->size);
+        if (err) {
+            if (pScrn)
+                xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+                           "posix_fallocate failed: %s\n", strerror(err));
+            close(buffer->fd);
+            free(buffer);
+            return NULL;
+        }
+    }
+
+    buffer->data = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE,
+                        flags, buffer->fd, 0);
+    if (buffer->data == MAP_FAILED) {
+        if (pScrn)
+            xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "mmap failed: %s\n",
+                       strerror(errno));
+        close(buffer->fd);
+        free(buffer);
+        return NULL;
+    }
+
+    /*
+     * Large buffers are worth huge pages: fb walks them linearly and
+     * would otherwise take a TLB miss every 4 KiB.  Only transparent
+     * ones though.  The fd goes to the compositor, which maps and unmaps
+     * it at the size xwayland declares, rarely a multiple of 2 MiB, and
+     * munmap of a partial huge page on hugetlbfs fails, leaking the
+     * compositor's mapping and its pinned pages.
+     */
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && class_size >= WLSHM_HUGE_THRESHOLD &&
+        madvise(buffer->data, buffer->size, MADV_HUGEPAGE) == 0)
+        buffer->huge = WLSHM_HUGE_THP;
+#endif
+
+    return buffer;
+}
+
+/* Count a new buffer in, on the main thread */
+static void
+wlshm_buffer_created(struct wlshm_pool *pool, struct wlshm_buffer *buffer)
+{
+    pool->buffers_created++;
+    pool->mapped_bytes += buffer->size;
+    if (buffer->huge != WLSHM_HUGE_NONE)
+        pool->huge_buffers_created++;
+    xf86DrvMsgVerb(pool->pScrn->scrnIndex, X_INFO, 5,
+                   "new %lu byte shm buffer, %s\n",
+                   (unsigned long)buffer->size,
+                   buffer->huge == WLSHM_HUGE_THP ? "transparent huge pages" :
+                   "regular pages");
+}
+
+/*
+ * Creating a buffer on the main thread means every client waits while
+ * the first copy into it faults in its pages one at a time.  The prep
+ * thread creates and populates buffers ahead of time instead: one for
+ * the screen size at startup, and a spare for every size class that
+ * had to be created on demand, up to prep_limit bytes in total.  These
+ * count against the memory budget, which drops them first.
+ */
+
+static void *
+wlshm_prep_main(void *data)
+{
+    struct wlshm_pool *pool = data;
+    struct wlshm_buffer *buffer;
+    size_t class_size;
+    int i;
+
+    pthread_mutex_lock(&pool->prep_lock);
+    for (;;) {
+        for (i = 0; i < WLSHM_POOL_NUM_CLASSES; i++)
+            if (pool->prep_want[i])
+                break;
+        if (pool->prep_quit)
+            break;
+        if (i == WLSHM_POOL_NUM_CLASSES) {
+            pthread_cond_wait(&pool->prep_cond, &pool->prep_lock);
+            continue;
+        }
+
+        pool->prep_want[i]--;
+        pthread_mutex_unlock(&pool->prep_lock);
+
+        wlshm_pool_class_size(i, &class_size);
+        buffer = wlshm_buffer_create(NULL, class_size, i,
+                                     pool->huge_pages, TRUE);
+
+        /* Requests are counted at class size, ready buffers at theirs */
+        pthread_mutex_lock(&pool->prep_lock);
+        pool->prep_bytes -= class_size;
+        if (!buffer)
+            continue;
+        pool->prep_bytes += buffer->size;
+        xorg_list_add(&buffer->class_link, &pool->prep_ready[i]);
+    }
+    pthread_mutex_unlock(&pool->prep_lock);
+
+    return NULL;
+}
+
+/* Ask the prep thread for a buffer of size_class, if there's room */
+static void
+wlshm_prep_request(struct wlshm_pool *pool, int size_class)
+{
+    size_t class_size;
+
+    if (!pool->prep_running || size_class < 0)
+        return;
+
+    wlshm_pool_class_size(size_class, &class_size);
+
+    pthread_mutex_lock(&pool->prep_lock);
+    if (pool->prep_bytes + class_size <= pool->prep_limit) {
+        pool->prep_want[size_class]++;
+        pool->prep_bytes += class_size;
+        pthread_cond_signal(&pool->prep_cond);
+    }
+    pthread_mutex_unlock(&pool->prep_lock);
+}
+
+static struct wlshm_buffer *
+wlshm_prep_take(struct wlshm_pool *pool, int size_class)
+{
+    struct wlshm_buffer *buffer = NULL;
+
+    if (!pool->prep_running || size_class < 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool->prep_lock);
+    if (!xorg_list_is_empty(&pool->prep_ready[size_class])) {
+        buffer = xorg_list_first_entry(&pool->prep_ready[size_class],
+                                       struct wlshm_buffer, class_link);
+        xorg_list_del(&buffer->class_link);
+        pool->prep_bytes -= buffer->size;
+    }
+    pthread_mutex_unlock(&pool->prep_lock);
+
+    return buffer;
+}
+
+/* Bytes the prep thread holds or is about to, ready buffers included */
+size_t
+wlshm_pool_prep_bytes(struct wlshm_pool *pool)
+{
+    size_t bytes;
+
+    if (!pool->prep_running)
+        return 0;
+
+    pthread_mutex_lock(&pool->prep_lock);
+    bytes = pool->prep_bytes;
+    pthread_mutex_unlock(&pool->prep_lock);
+
+    return bytes;
+}
+
+/* Never handed out, so never counted in mapped_bytes */
+static void
+wlshm_prep_free(struct wlshm_buffer *buffer)
+{
+    munmap(buffer->data, buffer->size);
+    close(buffer->fd);
+    free(buffer);
+}
+
+/*
+ * Cancel pending prep requests and unmap ready buffers, largest class
+ * first, until the prep thread holds at most limit bytes.  A buffer
+ * being populated right now can't be stopped and is left to the next
+ * call.
+ */
+void
+wlshm_pool_drop_prep(struct wlshm_pool *pool, size_t limit)
+{
+    struct wlshm_buffer *buffer;
+    size_t class_size;
+    int i;
+
+    if (!pool->prep_running)
+        return;
+
+    pthread_mutex_lock(&pool->prep_lock);
+    for (i = WLSHM_POOL_NUM_CLASSES - 1;
+         i >= 0 && pool->prep_bytes > limit; i--) {
+        wlshm_pool_class_size(i, &class_size);
+        while (pool->prep_want[i] && pool->prep_bytes > limit) {
+            pool->prep_want[i]--;
+            pool->prep_bytes -= class_size;
+        }
+        while (!xorg_list_is_empty(&pool->prep_ready[i]) &&
+               pool->prep_bytes > limit) {
+            buffer = xorg_list_first_entry(&pool->prep_ready[i],
+                                           struct wlshm_buffer, class_link);
+            xorg_list_del(&buffer->class_link);
+            pool->prep_bytes -= buffer->size;
+            wlshm_prep_free(buffer);
+        }
+    }
+    pthread_mutex_unlock(&pool->prep_lock);
+}
+
+/* Have a populated buffer ready for windows of size bytes */
+void
+wlshm_pool_expect(struct wlshm_pool *pool, size_t size)
+{
+    size_t class_size;
+
+    wlshm_prep_request(pool, wlshm_pool_size_class(size, &class_size));
+}
+
+void
+wlshm_pool_init(struct wlshm_pool *pool, ScrnInfoPtr pScrn, size_t limit,
+                Bool huge_pages, size_t prep_limit)
+{
+    sigset_t old;
+    int i, err;
+
+    pool->pScrn = pScrn;
+    for (i = 0; i < WLSHM_POOL_NUM_CLASSES; i++) {
+        xorg_list_init(&pool->free[i]);
+        xorg_list_init(&pool->prep_ready[i]);
+        pool->prep_want[i] = 0;
+    }
+    xorg_list_init(&pool->lru);
+    pool->free_bytes = 0;
+    pool->limit = limit;
+    pool->huge_pages = huge_pages;
+    pool->buffers_created = 0;
+    pool->buffers_destroyed = 0;
+    pool->huge_buffers_created = 0;
+    pool->mapped_bytes = 0;
+    pool->prep_running = FALSE;
+    pool->prep_quit = FALSE;
+    pool->prep_bytes = 0;
+    pool->prep_limit = prep_limit;
+    pool->prep_hits = 0;
+
+    if (!prep_limit)
+        return;
+
+    pthread_mutex_init(&pool->prep_lock, NULL);
+    pthread_cond_init(&pool->prep_cond, NULL);
+
+    /* Signals are the main thread's business */
+    wlshm_threads_block_signals(&old);
+    err = pthread_create(&pool->prep_thread, NULL, wlshm_prep_main, pool);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                   "can't create buffer prep thread: %s\n", strerror(err));
+        pthread_cond_destroy(&pool->prep_cond);
+        pthread_mutex_destroy(&pool->prep_lock);
+        return;
+    }
+    pool->prep_running = TRUE;
+}
+
+void
+wlshm_pool_fini(struct wlshm_pool *pool)
+{
+    struct wlshm_buffer *buffer, *tmp;
+    int i;
+
+    if (pool->prep_running) {
+        pthread_mutex_lock(&pool->prep_lock);
+        pool->prep_quit = TRUE;
+        pthread_cond_signal(&pool->prep_cond);
+        pthread_mutex_unlock(&pool->prep_lock);
+        pthread_join(pool->prep_thread, NULL);
+
+        for (i = 0; i < WLSHM_POOL_NUM_CLASSES; i++) {
+            xorg_list_for_each_entry_safe(buffer, tmp, &pool->prep_ready[i],
+                                          class_link) {
+                xorg_list_del(&buffer->class_link);
+                wlshm_prep_free(buffer);
+            }
+        }
+
+        pthread_cond_destroy(&pool->prep_cond);
+        pthread_mutex_destroy(&pool->prep_lock);
+        pool->prep_running = FALSE;
+    }
+
+    xorg_list_for_each_entry_safe(buffer, tmp, &pool->lru, lru_link) {
+        wlshm_pool_remove(pool, buffer);
+        wlshm_buffer_destroy(pool, buffer);
+    }
+}
+
+struct wlshm_buffer *
+wlshm_pool_get(struct wlshm_pool *pool, size_t size)
+{
+    struct wlshm_buffer *buffer;
+    size_t class_size;
+    int size_class;
+
+    /* The oldest free buffer of the class is the one most likely off screen */
+    size_class = wlshm_pool_size_class(size, &class_size);
+    if (size_class >= 0 && !xorg_list_is_empty(&pool->free[size_class])) {
+        buffer = xorg_list_last_entry(&pool->free[size_class],
+                                      struct wlshm_buffer, class_link);
+        if (GetTimeInMillis() - buffer->freed >= WLSHM_POOL_GRACE_MS) {
+            wlshm_pool_remove(pool, buffer);
+            return buffer;
+        }
+    }
+
+    buffer = wlshm_prep_take(pool, size_class);
+    if (buffer) {
+        pool->prep_hits++;
+    } else {
+        buffer = wlshm_buffer_create(pool->pScrn, class_size, size_class,
+                                     pool->huge_pages, FALSE);
+        if (!buffer)
+            return NULL;
+    }
+    wlshm_buffer_created(pool, buffer);
+
+    /* Windows of this size come and go, keep one ready */
+    wlshm_prep_request(pool, size_class);
+
+    return buffer;
+}
+
+void
+wlshm_pool_put(struct wlshm_pool *pool, struct wlshm_buffer *buffer)
+{
+    if (buffer->size_class < 0 || buffer->size > pool->limit) {
+        wlshm_buffer_destroy(pool, buffer);
+        return;
+    }
+
+    buffer->freed = GetTimeInMillis();
+    xorg_list_add(&buffer->class_link, &pool->free[buffer->size_class]);
+    xorg_list_add(&buffer->lru_link, &pool->lru);
+    pool->free_bytes += buffer->size;
+
+    wlshm_pool_trim(pool, pool->limit);
+}
+
+/* Give back the least recently used idle buffers past limit bytes */
+void
+wlshm_pool_trim(struct wlshm_pool *pool, size_t limit)
+{
+    struct wlshm_buffer *buffer;
+
+    while (pool->free_bytes > limit) {
+        buffer = xorg_list_last_entry(&pool->lru, struct wlshm_buffer,
+                                      lru_link);
+        wlshm_pool_remove(pool, buffer);
+        wlshm_buffer_destroy(pool, buffer);
+    }
+}
@@ -0,0 +1,133 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+/*
+ * The pixman side of banded rendering, see wlshm_render.c.  Nothing in
+ * here touches server structures, which lets make check hold banded
+ * output against a single pixman call.
+ *
+ * An operation is cut into horizontal bands of whole rows.  Each band
+ * is the same pixman operation on the same inputs, clipped to its rows,
+ * so every destination pixel comes out exactly as it would have from
+ * the whole thing.
+ */
+
+/* Operations covering fewer pixels than this aren't worth splitting */
+#define WLSHM_RASTER_THRESHOLD	(512 * 512)
+#define WLSHM_RASTER_MIN_ROWS	32
+
+/*
+ * How many bands to split pixels spread over height rows into, 1 when
+ * it is not worth it.
+ */
+int
+wlshm_raster_bands(struct wlshm_threads *threads, int64_t pixels, int height)
+{
+    int bands;
+
+    if (!threads || threads->count == 0 || pixels < WLSHM_RASTER_THRESHOLD)
+        return 1;
+
+    bands = min(threads->count + 1, height / WLSHM_RASTER_MIN_ROWS);
+    return max(bands, 1);
+}
+
+static void
+wlshm_raster_composite_band(void *arg, int band, int bands)
+{
+    struct wlshm_composite_job *job = arg;
+    struct wlshm_composite_images *images = &job->images[band];
+    int y1 = job->height * band / bands;
+    int y2 = job->height * (band + 1) / bands;
+
+    pixman_image_composite32(job->op, images->src, images->mask, images->dest,
+                             job->src_x, job->src_y + y1,
+                             job->mask_x, job->mask_y + y1,
+                             job->dest_x, job->dest_y + y1,
+                             job->width, y2 - y1);
+}
+
+/*
+ * Composite job in bands, each with its own set of images.  pixman
+ * validates an image lazily on first use, and images shared between
+ * threads would race there.
+ */
+void
+wlshm_raster_composite(struct wlshm_threads *threads,
+                       struct wlshm_composite_job *job, int bands)
+{
+    wlshm_threads_run(threads, bands, wlshm_raster_composite_band, job);
+}
+
+struct wlshm_fill_job {
+    uint32_t *bits;
+    int stride;
+    int bpp;
+    const BoxRec *boxes;
+    int nbox;
+    int x_off, y_off;
+    uint32_t pixel;
+    int y1, y2;
+};
+
+static void
+wlshm_raster_fill_band(void *arg, int band, int bands)
+{
+    struct wlshm_fill_job *job = arg;
+    int height = job->y2 - job->y1;
+    int y1 = job->y1 + height * band / bands;
+    int y2 = job->y1 + height * (band + 1) / bands;
+    const BoxRec *box = job->boxes;
+    int n, top, bottom;
+
+    for (n = job->nbox; n--; box++) {
+        top = max(box->y1, y1);
+        bottom = min(box->y2, y2);
+        if (top >= bottom || box->x1 >= box->x2)
+            continue;
+        pixman_fill(job->bits, job->stride, job->bpp,
+                    box->x1 + job->x_off, top + job->y_off,
+                    box->x2 - box->x1, bottom - top, job->pixel);
+    }
+}
+
+/*
+ * Solid fill boxes, offset by x_off, y_off, with pixel.  stride is in
+ * uint32_t units, as for pixman_fill().
+ */
+void
+wlshm_raster_fill(struct wlshm_threads *threads, uint32_t *bits, int stride,
+                  int bpp, const BoxRec *boxes, int nbox, int x_off, int y_off,
+                  uint32_t pixel)
+{
+    struct wlshm_fill_job job;
+    int64_t pixels = 0;
+    int i;
+
+    if (nbox <= 0)
+        return;
+
+    job.bits = bits;
+    job.stride = stride;
+    job.bpp = bpp;
+    job.boxes = boxes;
+    job.nbox = nbox;
+    job.x_off = x_off;
+    job.y_off = y_off;
+    job.pixel = pixel;
+    job.y1 = boxes[0].y1;
+    job.y2 = boxes[0].y2;
+    for (i = 0; i < nbox; i++) {
+        job.y1 = min(job.y1, boxes[i].y1);
+        job.y2 = max(job.y2, boxes[i].y2);
+        pixels += (int64_t)(boxes[i].x2 - boxes[i].x1) *
+            (boxes[i].y2 - boxes[i].y1);
+    }
+
+    wlshm_threads_run(threads,
+                      wlshm_raster_bands(threads, pixels, job.y2 - job.y1),
+                      wlshm_raster_fill_band, &job);
+}
@@ -0,0 +1,483 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#include "fb.h"
+#include "gcstruct.h"
+#include "mi.h"
+#include "picturestr.h"
+#include "mipict.h"
+#include "servermd.h"
+
+/*
+ * Rendering onto window buffers, split across the copy threads.
+ *
+ * Render Composite does what fbComposite does, except that large
+ * operations are cut into horizontal bands that pixman composites in
+ * parallel, see wlshm_raster.c.  Transformed sources and alpha maps are
+ * left to fb: pixman may pick a different filtering path for a band than
+ * for the whole area, and those paths aren't guaranteed to agree to the
+ * bit.  So are sources and masks on the destination's own pixmap: a band
+ * would read rows another band is writing.
+ *
+ * Of the core GC operations, the ones that move the most pixels are
+ * wrapped the same way, by swapping them into a copy of the ops fb
+ * installs on every ValidateGC:
+ *  - PolyFillRect, for solid fills fb would hand to pixman_fill; this
+ *    includes window background and border exposes from miPaintWindow.
+ *  - CopyArea between different pixmaps, through miDoCopy so clipping
+ *    and graphics exposures are fb's.  A copy within one pixmap is
+ *    mostly a scroll, and fb orders it by direction, which concurrent
+ *    bands would break.
+ *  - PutImage of ZPixmap data.
+ * Only GXcopy with every plane enabled is taken, where fb copies or
+ * fills whole pixels, so each pixel comes out the same as from fb.
+ */
+
+/* Core GC operations, see the top of the file */
+
+static DevPrivateKeyRec wlshm_gc_private_key;
+
+struct wlshm_gc {
+    GCFuncs *funcs;
+    /* The ops below us, NULL unless ours are swapped in */
+    GCOps *ops;
+    /* A copy of ops with the banded operations in place */
+    GCOps banded_ops;
+};
+
+static inline struct wlshm_gc *
+wlshm_gc_priv(GCPtr pGC)
+{
+    return dixGetPrivateAddr(&pGC->devPrivates, &wlshm_gc_private_key);
+}
+
+static PixmapPtr
+wlshm_drawable_pixmap(DrawablePtr pDrawable)
+{
+    if (pDrawable->type == DRAWABLE_WINDOW)
+        return (*pDrawable->pScreen->GetWindowPixmap)((WindowPtr)pDrawable);
+    return (PixmapPtr)pDrawable;
+}
+
+/* A GC that replaces whole destination pixels, onto a window buffer */
+static Bool
+wlshm_gc_is_banded(DrawablePtr pDrawable, GCPtr pGC, int64_t pixels,
+                   int height)
+{
+    struct wlshm_device *wlshm = wlshm_screen_priv(pDrawable->pScreen);
+    FbGCPrivPtr pPriv = fbGetGCPrivate(pGC);
+
+    if (pGC->alu != GXcopy || pPriv->pm != FB_ALLONES ||
+        pDrawable->bitsPerPixel != 32)
+        return FALSE;
+
+    if (wlshm_raster_bands(&wlshm->threads, pixels, height) < 2)
+        return FALSE;
+
+    return wlshm_get_pixmap(wlshm_drawable_pixmap(pDrawable)) != NULL;
+}
+
+static void
+wlshm_poly_fill_rect(DrawablePtr pDrawable, GCPtr pGC, int nrect,
+                     xRectangle *prect)
+{
+    struct wlshm_device *wlshm = wlshm_screen_priv(pDrawable->pScreen);
+    struct wlshm_gc *priv = wlshm_gc_priv(pGC);
+    FbGCPrivPtr pPriv = fbGetGCPrivate(pGC);
+    FbBits *bits;
+    FbStride stride;
+    int bpp, xoff, yoff, i;
+    int64_t pixels = 0;
+    RegionPtr region;
+
+    for (i = 0; i < nrect; i++)
+        pixels += (int64_t)prect[i].width * prect[i].height;
+
+    /* fb only uses pixman_fill when nothing of the old pixel is kept */
+    if (pGC->fillStyle != FillSolid || pPriv->and ||
+        !wlshm_gc_is_banded(pDrawable, pGC, pixels, pDrawable->height)) {
+        (*priv->ops->PolyFillRect)(pDrawable, pGC, nrect, prect);
+        return;
+    }
+
+    /*
+     * Overlapping rectangles are filled with the same pixel, so their
+     * union clipped like fbPolyFillRect clips each one is the same fill.
+     */
+    region = RegionFromRects(nrect, prect, CT_UNSORTED);
+    if (!region) {
+        (*priv->ops->PolyFillRect)(pDrawable, pGC, nrect, prect);
+        return;
+    }
+    RegionTranslate(region, pDrawable->x, pDrawable->y);
+    RegionIntersect(region, region, fbGetCompositeClip(pGC));
+
+    fbGetDrawable(pDrawable, bits, stride, bpp, xoff, yoff);
+    wlshm_raster_fill(&wlshm->threads, (uint32_t *)bits, stride, bpp,
+                      RegionRects(region), RegionNumRects(region),
+                      xoff, yoff, pPriv->xor);
+    fbFinishAccess(pDrawable);
+
+    RegionDestroy(region);
+}
+
+/* A miCopyProc doing what fbCopyNtoN does for GXcopy, in bands */
+static void
+wlshm_copy_boxes(DrawablePtr pSrcDrawable, DrawablePtr pDstDrawable,
+                 GCPtr pGC, BoxPtr pbox, int nbox, int dx, int dy,
+                 Bool reverse, Bool upsidedown, Pixel bitplane,
+                 void *closure)
+{
+    struct wlshm_device *wlshm = wlshm_screen_priv(pDstDrawable->pScreen);
+    struct wlshm_pixmap *d =
+        wlshm_get_pixmap(wlshm_drawable_pixmap(pDstDrawable));
+    FbBits *src, *dst;
+    FbStride src_stride, dst_stride;
+    int src_bpp, dst_bpp, src_xoff, src_yoff, dst_xoff, dst_yoff, cpp;
+
+    fbGetDrawable(pSrcDrawable, src, src_stride, src_bpp, src_xoff, src_yoff);
+    fbGetDrawable(pDstDrawable, dst, dst_stride, dst_bpp, dst_xoff, dst_yoff);
+    cpp = dst_bpp / 8;
+    src_stride *= sizeof(FbBits);
+    dst_stride *= sizeof(FbBits);
+
+    while (nbox--) {
+        wlshm_copy_rect(&wlshm->threads,
+                        (uint8_t *)dst + (pbox->y1 + dst_yoff) * dst_stride +
+                        (pbox->x1 + dst_xoff) * cpp, dst_stride,
+                        (uint8_t *)src +
+                        (pbox->y1 + dy + src_yoff) * src_stride +
+                        (pbox->x1 + dx + src_xoff) * cpp, src_stride,
+                        (pbox->x2 - pbox->x1) * cpp, pbox->y2 - pbox->y1,
+                        d && !d->back_buffered);
+        pbox++;
+    }
+
+    fbFinishAccess(pDstDrawable);
+    fbFinishAccess(pSrcDrawable);
+}
+
+static RegionPtr
+wlshm_copy_area(DrawablePtr pSrcDrawable, DrawablePtr pDstDrawable, GCPtr pGC,
+                int srcx, int srcy, int width, int height, int dstx, int dsty)
+{
+    struct wlshm_gc *priv = wlshm_gc_priv(pGC);
+
+    /* Copies within one pixmap depend on fb's ordering, see above */
+    if (pSrcDrawable->bitsPerPixel != pDstDrawable->bitsPerPixel ||
+        wlshm_drawable_pixmap(pSrcDrawable) ==
+        wlshm_drawable_pixmap(pDstDrawable) ||
+        !wlshm_gc_is_banded(pDstDrawable, pGC, (int64_t)width * height,
+                            height))
+        return (*priv->ops->CopyArea)(pSrcDrawable, pDstDrawable, pGC,
+                                      srcx, srcy, width, height, dstx, dsty);
+
+    return miDoCopy(pSrcDrawable, pDstDrawable, pGC, srcx, srcy,
+                    width, height, dstx, dsty, wlshm_copy_boxes, 0, NULL);
+}
+
+/* What fbPutZImage does for GXcopy, with each clip box in bands */
+static void
+wlshm_put_image(DrawablePtr pDrawable, GCPtr pGC, int depth, int x, int y,
+                int w, int h, int leftPad, int format, char *pImage)
+{
+    struct wlshm_device *wlshm = wlshm_screen_priv(pDrawable->pScreen);
+    struct wlshm_gc *priv = wlshm_gc_priv(pGC);
+    struct wlshm_pixmap *d;
+    RegionPtr clip = fbGetCompositeClip(pGC);
+    BoxPtr pbox = RegionRects(clip);
+    int nbox = RegionNumRects(clip);
+    int src_stride, bpp, xoff, yoff, x1, y1, x2, y2;
+    FbBits *dst;
+    FbStride dst_stride;
+
+    if (format != ZPixmap ||
+        !wlshm_gc_is_banded(pDrawable, pGC, (int64_t)w * h, h)) {
+        (*priv->ops->PutImage)(pDrawable, pGC, depth, x, y, w, h,
+                               leftPad, format, pImage);
+        return;
+    }
+
+    d = wlshm_get_pixmap(wlshm_drawable_pixmap(pDrawable));
+    src_stride = PixmapBytePad(w, pDrawable->depth);
+    x += pDrawable->x;
+    y += pDrawable->y;
+
+    fbGetDrawable(pDrawable, dst, dst_stride, bpp, xoff, yoff);
+    dst_stride *= sizeof(FbBits);
+
+    for (; nbox--; pbox++) {
+        x1 = max(x, pbox->x1);
+        y1 = max(y, pbox->y1);
+        x2 = min(x + w, pbox->x2);
+        y2 = min(y + h, pbox->y2);
+        if (x1 >= x2 || y1 >= y2)
+            continue;
+
+        wlshm_copy_rect(&wlshm->threads,
+                        (uint8_t *)dst + (y1 + yoff) * dst_stride +
+                        (x1 + xoff) * 4, dst_stride,
+                        pImage + (y1 - y) * src_stride + (x1 - x) * 4,
+                        src_stride, (x2 - x1) * 4, y2 - y1,
+                        !d->back_buffered);
+    }
+
+    fbFinishAccess(pDrawable);
+}
+
+/* Put ours in front of whatever ops the GC has now */
+static void
+wlshm_gc_swap_ops(GCPtr pGC, struct wlshm_gc *priv)
+{
+    priv->ops = pGC->ops;
+    priv->banded_ops = *pGC->ops;
+    priv->banded_ops.PolyFillRect = wlshm_poly_fill_rect;
+    priv->banded_ops.CopyArea = wlshm_copy_area;
+    priv->banded_ops.PutImage = wlshm_put_image;
+    pGC->ops = &priv->banded_ops;
+}
+
+#define WLSHM_GC_FUNC_PROLOGUE(pGC) \
+    struct wlshm_gc *priv = wlshm_gc_priv(pGC); \
+    (pGC)->funcs = priv->funcs; \
+    if (priv->ops) \
+        (pGC)->ops = priv->ops
+
+#define WLSHM_GC_FUNC_EPILOGUE(pGC) \
+    priv->funcs = (pGC)->funcs; \
+    (pGC)->funcs = &wlshm_gc_funcs; \
+    if (priv->ops) \
+        wlshm_gc_swap_ops(pGC, priv)
+
+static GCFuncs wlshm_gc_funcs;
+
+static void
+wlshm_validate_gc(GCPtr pGC, unsigned long changes, DrawablePtr pDrawable)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ValidateGC)(pGC, changes, pDrawable);
+    priv->funcs = pGC->funcs;
+    pGC->funcs = &wlshm_gc_funcs;
+
+    /* fb has just picked its ops for this drawable */
+    priv->ops = NULL;
+    if (pDrawable->bitsPerPixel == 32 &&
+        wlshm_screen_priv(pGC->pScreen)->threads.count)
+        wlshm_gc_swap_ops(pGC, priv);
+}
+
+static void
+wlshm_change_gc(GCPtr pGC, unsigned long mask)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeGC)(pGC, mask);
+    WLSHM_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+wlshm_copy_gc(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGCDst);
+    (*pGCDst->funcs->CopyGC)(pGCSrc, mask, pGCDst);
+    WLSHM_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static void
+wlshm_destroy_gc(GCPtr pGC)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyGC)(pGC);
+    WLSHM_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+wlshm_change_clip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->ChangeClip)(pGC, type, pvalue, nrects);
+    WLSHM_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+wlshm_destroy_clip(GCPtr pGC)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGC);
+    (*pGC->funcs->DestroyClip)(pGC);
+    WLSHM_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+wlshm_copy_clip(GCPtr pGCDst, GCPtr pGCSrc)
+{
+    WLSHM_GC_FUNC_PROLOGUE(pGCDst);
+    (*pGCDst->funcs->CopyClip)(pGCDst, pGCSrc);
+    WLSHM_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static GCFuncs wlshm_gc_funcs = {
+    wlshm_validate_gc,
+    wlshm_change_gc,
+    wlshm_copy_gc,
+    wlshm_destroy_gc,
+    wlshm_change_clip,
+    wlshm_destroy_clip,
+    wlshm_copy_clip,
+};
+
+static Bool
+wlshm_create_gc(GCPtr pGC)
+{
+    ScreenPtr pScreen = pGC->pScreen;
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+    struct wlshm_gc *priv = wlshm_gc_priv(pGC);
+    Bool ret;
+
+    pScreen->CreateGC = wlshm->CreateGC;
+    ret = (*pScreen->CreateGC)(pGC);
+    wlshm->CreateGC = pScreen->CreateGC;
+    pScreen->CreateGC = wlshm_create_gc;
+
+    if (ret) {
+        priv->funcs = pGC->funcs;
+        priv->ops = NULL;
+        pGC->funcs = &wlshm_gc_funcs;
+    }
+
+    return ret;
+}
+
+/* Render */
+
+static PixmapPtr
+wlshm_picture_pixmap(PicturePtr pPicture)
+{
+    DrawablePtr pDrawable = pPicture ? pPicture->pDrawable : NULL;
+
+    if (!pDrawable)
+        return NULL;
+    return wlshm_drawable_pixmap(pDrawable);
+}
+
+static Bool
+wlshm_composite_is_banded(PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    PixmapPtr pixmap;
+
+    if (pSrc->transform || pSrc->alphaMap || pDst->alphaMap ||
+        (pMask && (pMask->transform || pMask->alphaMap)))
+        return FALSE;
+
+    pixmap = wlshm_picture_pixmap(pDst);
+    if (!pixmap)
+        return FALSE;
+
+    /* Reading what another band writes */
+    if (wlshm_picture_pixmap(pSrc) == pixmap ||
+        wlshm_picture_pixmap(pMask) == pixmap)
+        return FALSE;
+
+    return wlshm_get_pixmap(pixmap) != NULL;
+}
+
+static void
+wlshm_composite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+                INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+                INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+    struct wlshm_composite_job job;
+    struct wlshm_composite_images *images = NULL;
+    int src_xoff, src_yoff, msk_xoff, msk_yoff, dst_xoff, dst_yoff;
+    int bands, i;
+    Bool ok = TRUE;
+
+    bands = wlshm_raster_bands(&wlshm->threads, (int64_t)width * height,
+                               height);
+    if (bands > 1 && wlshm_composite_is_banded(pSrc, pMask, pDst))
+        images = calloc(bands, sizeof(*images));
+
+    if (!images) {
+        ps->Composite = wlshm->Composite;
+        (*ps->Composite)(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                         xDst, yDst, width, height);
+        wlshm->Composite = ps->Composite;
+        ps->Composite = wlshm_composite;
+        return;
+    }
+
+    miCompositeSourceValidate(pSrc);
+    if (pMask)
+        miCompositeSourceValidate(pMask);
+
+    for (i = 0; i < bands && ok; i++) {
+        images[i].src = image_from_pict(pSrc, FALSE, &src_xoff, &src_yoff);
+        images[i].mask = image_from_pict(pMask, FALSE, &msk_xoff, &msk_yoff);
+        images[i].dest = image_from_pict(pDst, TRUE, &dst_xoff, &dst_yoff);
+        ok = images[i].src && images[i].dest && !(pMask && !images[i].mask);
+    }
+
+    if (ok) {
+        job.op = op;
+        job.images = images;
+        job.src_x = xSrc + src_xoff;
+        job.src_y = ySrc + src_yoff;
+        job.mask_x = xMask + msk_xoff;
+        job.mask_y = yMask + msk_yoff;
+        job.dest_x = xDst + dst_xoff;
+        job.dest_y = yDst + dst_yoff;
+        job.width = width;
+        job.height = height;
+
+        wlshm_raster_composite(&wlshm->threads, &job, bands);
+        wlshm->stats.composites_banded++;
+    }
+
+    for (i = 0; i < bands; i++) {
+        free_pixman_pict(pSrc, images[i].src);
+        free_pixman_pict(pMask, images[i].mask);
+        free_pixman_pict(pDst, images[i].dest);
+    }
+    free(images);
+}
+
+void
+wlshm_render_init(ScreenPtr pScreen)
+{
+    PictureScreenPtr ps = GetPictureScreenIfSet(pScreen);
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+
+    if (dixRegisterPrivateKey(&wlshm_gc_private_key, PRIVATE_GC,
+                              sizeof(struct wlshm_gc))) {
+        wlshm->CreateGC = pScreen->CreateGC;
+        pScreen->CreateGC = wlshm_create_gc;
+    }
+
+    if (!ps)
+        return;
+
+    wlshm->Composite = ps->Composite;
+    ps->Composite = wlshm_composite;
+}
+
+void
+wlshm_render_fini(ScreenPtr pScreen)
+{
+    PictureScreenPtr ps = GetPictureScreenIfSet(pScreen);
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+
+    if (wlshm->CreateGC) {
+        pScreen->CreateGC = wlshm->CreateGC;
+        wlshm->CreateGC = NULL;
+    }
+
+    if (!ps || !wlshm->Composite)
+        return;
+
+    ps->Composite = wlshm->Composite;
+    wlshm->Composite = NULL;
+}
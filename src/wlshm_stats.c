@@ -0,0 +1,177 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#include <signal.h>
+
+/*
+ * Counters are always kept; sending the server SIGUSR1 dumps them to
+ * the log.  The signal handler only bumps a count, the dump itself
+ * happens from the wakeup handler on the main thread.
+ */
+
+static volatile sig_atomic_t wlshm_stats_requests;
+static OsSigHandlerPtr wlshm_stats_old_handler;
+static int wlshm_stats_screens;
+
+static void
+wlshm_stats_signal(int sig)
+{
+    wlshm_stats_requests++;
+}
+
+static void
+wlshm_stats_wakeup(pointer data, int result, pointer read_mask)
+{
+    ScrnInfoPtr pScrn = data;
+    struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
+
+    if (wlshm->stats_seen == wlshm_stats_requests)
+        return;
+
+    wlshm->stats_seen = wlshm_stats_requests;
+    wlshm_stats_dump(pScrn, 0);
+}
+
+void
+wlshm_stats_init(ScrnInfoPtr pScrn)
+{
+    struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
+
+    memset(&wlshm->stats, 0, sizeof(wlshm->stats));
+    wlshm->stats_seen = wlshm_stats_requests;
+
+    RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+                                   wlshm_stats_wakeup, pScrn);
+
+    if (wlshm_stats_screens++ == 0)
+        wlshm_stats_old_handler = OsSignal(SIGUSR1, wlshm_stats_signal);
+}
+
+void
+wlshm_stats_fini(ScrnInfoPtr pScrn)
+{
+    RemoveBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
+                                 wlshm_stats_wakeup, pScrn);
+
+    if (--wlshm_stats_screens == 0)
+        OsSignal(SIGUSR1, wlshm_stats_old_handler);
+}
+
+void
+wlshm_stats_record_latency(uint32_t *buckets, long usec)
+{
+    int bucket = 0;
+
+    while (bucket < WLSHM_STATS_BUCKETS - 1 && usec >= (1L << bucket))
+        bucket++;
+    buckets[bucket]++;
+}
+
+static void
+wlshm_stats_dump_latency(ScrnInfoPtr pScrn, int verb, const char *what,
+                         const uint32_t *buckets)
+{
+    int i;
+
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb, "%s latency:\n", what);
+    for (i = 0; i < WLSHM_STATS_BUCKETS; i++) {
+        if (!buckets[i])
+            continue;
+        if (i < WLSHM_STATS_BUCKETS - 1)
+            xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                           "    < %6ld us: %u\n", 1L << i, buckets[i]);
+        else
+            xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                           "   >= %6ld us: %u\n", 1L << (i - 1), buckets[i]);
+    }
+}
+
+void
+wlshm_stats_dump(ScrnInfoPtr pScrn, int verb)
+{
+    struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
+    struct wlshm_stats *stats = &wlshm->stats;
+    struct wlshm_pool *pool = &wlshm->pool;
+    struct wlshm_pixmap *d;
+    CARD32 now = GetTimeInMillis();
+
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "window buffers: %llu attached (%llu bytes), "
+                   "%llu detached\n",
+                   (unsigned long long)stats->attached,
+                   (unsigned long long)stats->attached_bytes,
+                   (unsigned long long)stats->detached);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "retained buffers: %lu bytes, %llu reattached, "
+                   "%llu evicted\n",
+                   (unsigned long)wlshm->retained_bytes,
+                   (unsigned long long)stats->retain_hits,
+                   (unsigned long long)stats->retain_evictions);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "memory budget: %lu bytes released, %lu bytes compressed, "
+                   "%llu releases, %llu compressions, %llu decompressions "
+                   "(avg %llu us, max %llu us)\n",
+                   (unsigned long)wlshm->released_bytes,
+                   (unsigned long)wlshm->compressed_bytes,
+                   (unsigned long long)stats->releases,
+                   (unsigned long long)stats->compressions,
+                   (unsigned long long)stats->decompressions,
+                   (unsigned long long)(stats->decompressions ?
+                                        stats->decompress_usec /
+                                        stats->decompressions : 0),
+                   (unsigned long long)stats->decompress_max_usec);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "shm pool: %lu created, %lu destroyed, %lu on huge pages, "
+                   "%lu bytes mapped, %lu bytes idle, %lu prefaulted\n",
+                   pool->buffers_created, pool->buffers_destroyed,
+                   pool->huge_buffers_created,
+                   (unsigned long)pool->mapped_bytes,
+                   (unsigned long)pool->free_bytes, pool->prep_hits);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "copies: %llu bytes in, %llu bytes out, "
+                   "%llu bytes on commit, %llu bytes saved\n",
+                   (unsigned long long)stats->copy_in_bytes,
+                   (unsigned long long)stats->copy_out_bytes,
+                   (unsigned long long)stats->copy_commit_bytes,
+                   (unsigned long long)stats->copy_saved_bytes);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "tile filter: %llu damaged pixels unchanged\n",
+                   (unsigned long long)stats->tile_pixels_suppressed);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "damage: %llu rectangles simplified to %llu, "
+                   "%llu pixels added\n",
+                   (unsigned long long)stats->damage_rects_in,
+                   (unsigned long long)stats->damage_rects_out,
+                   (unsigned long long)stats->damage_overdraw);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "flushes: %llu, commits: %llu submitted, "
+                   "%llu flushes coalesced\n",
+                   (unsigned long long)stats->flushes,
+                   (unsigned long long)stats->commits,
+                   (unsigned long long)stats->commits_coalesced);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "composites split across threads: %llu\n",
+                   (unsigned long long)stats->composites_banded);
+    xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                   "Xv frames converted: %llu\n",
+                   (unsigned long long)stats->video_frames);
+
+    wlshm_stats_dump_latency(pScrn, verb, "window buffer creation",
+                             stats->create_usec);
+    wlshm_stats_dump_latency(pScrn, verb, "time to first frame",
+                             stats->first_frame_usec);
+
+    xorg_list_for_each_entry(d, &wlshm->pixmaps, link) {
+        xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, verb,
+                       "    %dx%d window buffer%s: %lu ms old, %llu commits, "
+                       "%llu bytes copied\n",
+                       d->pixmap->drawable.width, d->pixmap->drawable.height,
+                       d->back_buffered ? " (back buffered)" : "",
+                       (unsigned long)(now - d->attach_time),
+                       (unsigned long long)d->commits,
+                       (unsigned long long)d->copy_bytes);
+    }
+}
@@ -0,0 +1,163 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#include <signal.h>
+#include <errno.h>
+
+/*
+ * A small pool of worker threads for splitting large copies into bands.
+ *
+ * wlshm_threads_run() hands out bands to the workers and the calling
+ * thread alike, and only returns once every band is done, so callers
+ * can treat it like a plain function call: nothing is left running
+ * when fb gets to touch the pixmap again.
+ */
+
+/* Called with threads->lock held */
+static void
+wlshm_threads_work(struct wlshm_threads *threads)
+{
+    while (threads->next_band < threads->bands) {
+        int band = threads->next_band++;
+
+        pthread_mutex_unlock(&threads->lock);
+        threads->func(threads->arg, band, threads->bands);
+        pthread_mutex_lock(&threads->lock);
+
+        if (++threads->bands_done == threads->bands)
+            pthread_cond_signal(&threads->done_cond);
+    }
+}
+
+static void *
+wlshm_thread_main(void *data)
+{
+    struct wlshm_threads *threads = data;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&threads->lock);
+    for (;;) {
+        while (!threads->quit && threads->generation == generation)
+            pthread_cond_wait(&threads->work_cond, &threads->lock);
+        if (threads->quit)
+            break;
+
+        generation = threads->generation;
+        wlshm_threads_work(threads);
+    }
+    pthread_mutex_unlock(&threads->lock);
+
+    return NULL;
+}
+
+/*
+ * Block what signals a thread about to be created inherits, returning
+ * the old mask in old.  Asynchronous signals are the main thread's
+ * business, but a fault in a thread's own code has to reach the
+ * server's fatal signal handler for a backtrace, or blocking it just
+ * kills the process silently.
+ */
+void
+wlshm_threads_block_signals(sigset_t *old)
+{
+    sigset_t set;
+
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGILL);
+    sigdelset(&set, SIGABRT);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+Bool
+wlshm_threads_init(struct wlshm_threads *threads, ScrnInfoPtr pScrn,
+                   int count)
+{
+    sigset_t old;
+    int i, err;
+
+    memset(threads, 0, sizeof(*threads));
+    if (count <= 0)
+        return TRUE;
+
+    threads->threads = calloc(count, sizeof(pthread_t));
+    if (!threads->threads)
+        return FALSE;
+
+    pthread_mutex_init(&threads->lock, NULL);
+    pthread_cond_init(&threads->work_cond, NULL);
+    pthread_cond_init(&threads->done_cond, NULL);
+
+    wlshm_threads_block_signals(&old);
+
+    for (i = 0; i < count; i++) {
+        err = pthread_create(&threads->threads[i], NULL,
+                             wlshm_thread_main, threads);
+        if (err) {
+            xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+                       "can't create copy thread: %s\n", strerror(err));
+            break;
+        }
+    }
+    threads->count = i;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return TRUE;
+}
+
+void
+wlshm_threads_fini(struct wlshm_threads *threads)
+{
+    int i;
+
+    if (!threads->threads)
+        return;
+
+    pthread_mutex_lock(&threads->lock);
+    threads->quit = TRUE;
+    pthread_cond_broadcast(&threads->work_cond);
+    pthread_mutex_unlock(&threads->lock);
+
+    for (i = 0; i < threads->count; i++)
+        pthread_join(threads->threads[i], NULL);
+
+    pthread_cond_destroy(&threads->done_cond);
+    pthread_cond_destroy(&threads->work_cond);
+    pthread_mutex_destroy(&threads->lock);
+    free(threads->threads);
+    threads->threads = NULL;
+    threads->count = 0;
+}
+
+void
+wlshm_threads_run(struct wlshm_threads *threads, int bands,
+                  wlshm_band_proc func, void *arg)
+{
+    int i;
+
+    if (!threads || threads->count == 0 || bands <= 1) {
+        for (i = 0; i < bands; i++)
+            func(arg, i, bands);
+        return;
+    }
+
+    pthread_mutex_lock(&threads->lock);
+    threads->func = func;
+    threads->arg = arg;
+    threads->bands = bands;
+    threads->next_band = 0;
+    threads->bands_done = 0;
+    threads->generation++;
+    pthread_cond_broadcast(&threads->work_cond);
+
+    wlshm_threads_work(threads);
+    while (threads->bands_done < threads->bands)
+        pthread_cond_wait(&threads->done_cond, &threads->lock);
+    pthread_mutex_unlock(&threads->lock);
+}
@@ -0,0 +1,439 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define WLSHM_TILES_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Plenty of clients repaint whole windows with the same pixels.  With
+ * the TileFilter option, back buffered pixmaps keep a hash of every
+ * WLSHM_TILE_SIZE square tile of what is in shm, and a commit only
+ * copies the damaged tiles whose hash changed.
+ *
+ * Outside of damage, shm always matches the back buffer, so a tile
+ * whose hash didn't change has nothing to copy.
+ */
+
+#define WLSHM_TILE_SIZE		64
+
+/* Hashing fewer tiles than this isn't worth waking other threads for */
+#define WLSHM_TILES_THREAD_MIN	64
+
+typedef uint64_t (*wlshm_hash_proc)(const uint8_t *src, int stride,
+                                    int width, int height);
+
+/*
+ * The tile hash is 64 bits over every byte of the tile, in the style of
+ * XXH3: four 64 bit lanes take a 32 byte stripe at a time, each lane
+ * adding its word plus the 32x32->64 bit product of the word's halves
+ * keyed, and every row is scrambled into the lanes before the next one.
+ * The lanes are folded and avalanched at the end.  The SIMD kernels do
+ * the very same arithmetic, four lanes to a register, so every kernel
+ * gives the same hash.
+ *
+ * Within a row the lanes only ever add, so the key moves on by
+ * WLSHM_HASH_PRIME for every stripe; with the same key throughout,
+ * swapping two stripes of a row would leave the hash as it was.
+ */
+
+#define WLSHM_HASH_PRIME	0x9e3779b97f4a7c15ull
+#define WLSHM_HASH_PRIME32	0x9e3779b1u
+#define WLSHM_HASH_STRIPE	32
+
+static const uint64_t wlshm_hash_key[4] = {
+    0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull,
+    0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull,
+};
+
+static const uint64_t wlshm_hash_seed[4] = {
+    0xc2b2ae3d27d4eb4full, 0x9e3779b97f4a7c15ull,
+    0x165667b19e3779f9ull, 0x85ebca77c2b2ae63ull,
+};
+
+/* Stripe n of a row */
+static inline void
+wlshm_hash_stripe(uint64_t acc[4], const uint8_t *src, int n)
+{
+    uint64_t w, k;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        memcpy(&w, src + i * 8, 8);
+        k = w ^ (wlshm_hash_key[i] + n * WLSHM_HASH_PRIME);
+        acc[i] += w + (k & 0xffffffff) * (k >> 32);
+    }
+}
+
+/* The last, short, stripe of a row, zero padded */
+static inline void
+wlshm_hash_tail(uint64_t acc[4], const uint8_t *src, int len, int n)
+{
+    uint8_t stripe[WLSHM_HASH_STRIPE] = { 0 };
+
+    memcpy(stripe, src, len);
+    wlshm_hash_stripe(acc, stripe, n);
+}
+
+static inline void
+wlshm_hash_scramble(uint64_t acc[4])
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= wlshm_hash_key[i];
+        acc[i] *= WLSHM_HASH_PRIME32;
+    }
+}
+
+static inline uint64_t
+wlshm_hash_finish(const uint64_t acc[4])
+{
+    uint64_t h = WLSHM_HASH_PRIME;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        h = (h ^ acc[i]) * WLSHM_HASH_PRIME;
+        h ^= h >> 32;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static uint64_t
+wlshm_hash_c(const uint8_t *src, int stride, int width, int height)
+{
+    uint64_t acc[4];
+    int x;
+
+    memcpy(acc, wlshm_hash_seed, sizeof(acc));
+    while (height--) {
+        for (x = 0; x + WLSHM_HASH_STRIPE <= width; x += WLSHM_HASH_STRIPE)
+            wlshm_hash_stripe(acc, src + x, x / WLSHM_HASH_STRIPE);
+        if (x < width)
+            wlshm_hash_tail(acc, src + x, width - x, x / WLSHM_HASH_STRIPE);
+        wlshm_hash_scramble(acc);
+        src += stride;
+    }
+
+    return wlshm_hash_finish(acc);
+}
+
+#ifdef WLSHM_TILES_X86
+
+/* 64 bit lanes times a 32 bit constant, from two 32x32->64 products */
+__attribute__((target("sse2")))
+static inline __m128i
+wlshm_hash_mul32_sse2(__m128i a, __m128i prime)
+{
+    __m128i lo = _mm_mul_epu32(a, prime);
+    __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+
+    return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+wlshm_hash_stripe_sse2(__m128i acc, __m128i w, __m128i key)
+{
+    __m128i k = _mm_xor_si128(w, key);
+
+    return _mm_add_epi64(acc, _mm_add_epi64(w,
+                         _mm_mul_epu32(k, _mm_srli_epi64(k, 32))));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i
+wlshm_hash_scramble_sse2(__m128i acc, __m128i key, __m128i prime)
+{
+    acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+    return wlshm_hash_mul32_sse2(_mm_xor_si128(acc, key), prime);
+}
+
+__attribute__((target("sse2")))
+static uint64_t
+wlshm_hash_sse2(const uint8_t *src, int stride, int width, int height)
+{
+    const __m128i key0 = _mm_loadu_si128((const __m128i *)wlshm_hash_key);
+    const __m128i key1 = _mm_loadu_si128((const __m128i *)wlshm_hash_key + 1);
+    const __m128i prime = _mm_set1_epi32(WLSHM_HASH_PRIME32);
+    const __m128i step = _mm_set1_epi64x(WLSHM_HASH_PRIME);
+    __m128i acc0 = _mm_loadu_si128((const __m128i *)wlshm_hash_seed);
+    __m128i acc1 = _mm_loadu_si128((const __m128i *)wlshm_hash_seed + 1);
+    __m128i k0, k1;
+    uint64_t acc[4];
+    int x;
+
+    while (height--) {
+        k0 = key0;
+        k1 = key1;
+        for (x = 0; x + WLSHM_HASH_STRIPE <= width; x += WLSHM_HASH_STRIPE) {
+            acc0 = wlshm_hash_stripe_sse2(acc0,
+                _mm_loadu_si128((const __m128i *)(src + x)), k0);
+            acc1 = wlshm_hash_stripe_sse2(acc1,
+                _mm_loadu_si128((const __m128i *)(src + x + 16)), k1);
+            k0 = _mm_add_epi64(k0, step);
+            k1 = _mm_add_epi64(k1, step);
+        }
+        if (x < width) {
+            _mm_storeu_si128((__m128i *)acc, acc0);
+            _mm_storeu_si128((__m128i *)acc + 1, acc1);
+            wlshm_hash_tail(acc, src + x, width - x, x / WLSHM_HASH_STRIPE);
+            acc0 = _mm_loadu_si128((const __m128i *)acc);
+            acc1 = _mm_loadu_si128((const __m128i *)acc + 1);
+        }
+        acc0 = wlshm_hash_scramble_sse2(acc0, key0, prime);
+        acc1 = wlshm_hash_scramble_sse2(acc1, key1, prime);
+        src += stride;
+    }
+
+    _mm_storeu_si128((__m128i *)acc, acc0);
+    _mm_storeu_si128((__m128i *)acc + 1, acc1);
+    return wlshm_hash_finish(acc);
+}
+
+__attribute__((target("avx2")))
+static uint64_t
+wlshm_hash_avx2(const uint8_t *src, int stride, int width, int height)
+{
+    const __m256i key = _mm256_loadu_si256((const __m256i *)wlshm_hash_key);
+    const __m256i prime = _mm256_set1_epi32(WLSHM_HASH_PRIME32);
+    const __m256i step = _mm256_set1_epi64x(WLSHM_HASH_PRIME);
+    __m256i acc = _mm256_loadu_si256((const __m256i *)wlshm_hash_seed);
+    __m256i w, k, n, lo, hi;
+    uint64_t out[4];
+    int x;
+
+    while (height--) {
+        n = key;
+        for (x = 0; x + WLSHM_HASH_STRIPE <= width; x += WLSHM_HASH_STRIPE) {
+            w = _mm256_loadu_si256((const __m256i *)(src + x));
+            k = _mm256_xor_si256(w, n);
+            acc = _mm256_add_epi64(acc, _mm256_add_epi64(w,
+                      _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32))));
+            n = _mm256_add_epi64(n, step);
+        }
+        if (x < width) {
+            _mm256_storeu_si256((__m256i *)out, acc);
+            wlshm_hash_tail(out, src + x, width - x, x / WLSHM_HASH_STRIPE);
+            acc = _mm256_loadu_si256((const __m256i *)out);
+        }
+        acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+        acc = _mm256_xor_si256(acc, key);
+        lo = _mm256_mul_epu32(acc, prime);
+        hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+        acc = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        src += stride;
+    }
+
+    _mm256_storeu_si256((__m256i *)out, acc);
+    return wlshm_hash_finish(out);
+}
+
+#endif
+
+static wlshm_hash_proc wlshm_hash = wlshm_hash_c;
+static const char *wlshm_hash_name = "C";
+
+void
+wlshm_tiles_init(void)
+{
+#ifdef WLSHM_TILES_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        wlshm_hash = wlshm_hash_avx2;
+        wlshm_hash_name = "AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        wlshm_hash = wlshm_hash_sse2;
+        wlshm_hash_name = "SSE2";
+    }
+#endif
+}
+
+const char *
+wlshm_tiles_kernel_name(void)
+{
+    return wlshm_hash_name;
+}
+
+static uint64_t
+wlshm_tile_hash(PixmapPtr pixmap, int tx, int ty)
+{
+    int cpp = pixmap->drawable.bitsPerPixel / 8;
+    int x = tx * WLSHM_TILE_SIZE, y = ty * WLSHM_TILE_SIZE;
+    int w = min(WLSHM_TILE_SIZE, pixmap->drawable.width - x);
+    int h = min(WLSHM_TILE_SIZE, pixmap->drawable.height - y);
+    const uint8_t *src = pixmap->devPrivate.ptr;
+
+    return wlshm_hash(src + (size_t)y * pixmap->devKind + x * cpp,
+                      pixmap->devKind, w * cpp, h);
+}
+
+/* Start tracking the tiles of a back buffered pixmap */
+Bool
+wlshm_tiles_attach(struct wlshm_pixmap *d)
+{
+    PixmapPtr pixmap = d->pixmap;
+    int tx, ty, n;
+
+    d->tiles_x = (pixmap->drawable.width + WLSHM_TILE_SIZE - 1) /
+        WLSHM_TILE_SIZE;
+    d->tiles_y = (pixmap->drawable.height + WLSHM_TILE_SIZE - 1) /
+        WLSHM_TILE_SIZE;
+    n = d->tiles_x * d->tiles_y;
+
+    d->tile_hash = malloc(n * sizeof(*d->tile_hash));
+    d->tile_todo = malloc(n * sizeof(*d->tile_todo));
+    if (!d->tile_hash || !d->tile_todo) {
+        wlshm_tiles_detach(d);
+        return FALSE;
+    }
+
+    for (ty = 0; ty < d->tiles_y; ty++)
+        for (tx = 0; tx < d->tiles_x; tx++)
+            d->tile_hash[ty * d->tiles_x + tx] = wlshm_tile_hash(pixmap, tx, ty);
+
+    return TRUE;
+}
+
+void
+wlshm_tiles_detach(struct wlshm_pixmap *d)
+{
+    free(d->tile_hash);
+    free(d->tile_todo);
+    d->tile_hash = NULL;
+    d->tile_todo = NULL;
+}
+
+struct wlshm_tiles_job {
+    struct wlshm_pixmap *d;
+    int count;
+};
+
+/*
+ * Rehash the tiles listed in tile_todo.  Unchanged ones are marked by
+ * flipping their index negative.
+ */
+static void
+wlshm_tiles_band(void *arg, int band, int bands)
+{
+    struct wlshm_tiles_job *job = arg;
+    struct wlshm_pixmap *d = job->d;
+    int i = job->count * band / bands;
+    int end = job->count * (band + 1) / bands;
+    uint64_t hash;
+    int t;
+
+    for (; i < end; i++) {
+        t = d->tile_todo[i];
+        hash = wlshm_tile_hash(d->pixmap, t % d->tiles_x, t / d->tiles_x);
+        if (hash == d->tile_hash[t])
+            d->tile_todo[i] = -1 - t;
+        else
+            d->tile_hash[t] = hash;
+    }
+}
+
+/*
+ * Cut damage down to the tiles whose contents changed since the last
+ * commit and return how many damaged pixels were left out.
+ */
+uint64_t
+wlshm_tiles_filter(struct wlshm_threads *threads, struct wlshm_pixmap *d,
+                   RegionPtr damage)
+{
+    BoxPtr extents = RegionExtents(damage);
+    struct wlshm_tiles_job job;
+    xRectangle *rects;
+    RegionPtr changed;
+    uint64_t before;
+    BoxRec tile;
+    int tx, ty, tx1, tx2, ty1, ty2, i, t, n, same, bands = 1;
+
+    tx1 = max(extents->x1, 0) / WLSHM_TILE_SIZE;
+    ty1 = max(extents->y1, 0) / WLSHM_TILE_SIZE;
+    tx2 = min((extents->x2 + WLSHM_TILE_SIZE - 1) / WLSHM_TILE_SIZE,
+              d->tiles_x);
+    ty2 = min((extents->y2 + WLSHM_TILE_SIZE - 1) / WLSHM_TILE_SIZE,
+              d->tiles_y);
+
+    job.d = d;
+    job.count = 0;
+    for (ty = ty1; ty < ty2; ty++) {
+        for (tx = tx1; tx < tx2; tx++) {
+            tile.x1 = tx * WLSHM_TILE_SIZE;
+            tile.y1 = ty * WLSHM_TILE_SIZE;
+            tile.x2 = tile.x1 + WLSHM_TILE_SIZE;
+            tile.y2 = tile.y1 + WLSHM_TILE_SIZE;
+            if (RegionContainsRect(damage, &tile) != rgnOUT)
+                d->tile_todo[job.count++] = ty * d->tiles_x + tx;
+        }
+    }
+
+    if (job.count == 0)
+        return 0;
+
+    if (threads && threads->count > 0 &&
+        job.count >= WLSHM_TILES_THREAD_MIN)
+        bands = min(threads->count + 1, job.count / WLSHM_TILES_THREAD_MIN);
+    wlshm_threads_run(threads, bands, wlshm_tiles_band, &job);
+
+    /*
+     * Tiles were listed in y, x order, so runs of changed tiles along a
+     * row make a banded list of rectangles.
+     */
+    rects = malloc(job.count * sizeof(*rects));
+    if (!rects)
+        return 0;
+
+    n = 0;
+    same = 0;
+    for (i = 0; i < job.count; i++) {
+        t = d->tile_todo[i];
+        if (t < 0) {
+            same++;
+            continue;
+        }
+
+        tx = t % d->tiles_x;
+        ty = t / d->tiles_x;
+        if (n > 0 && rects[n - 1].y == ty * WLSHM_TILE_SIZE &&
+            rects[n - 1].x + rects[n - 1].width == tx * WLSHM_TILE_SIZE) {
+            rects[n - 1].width += WLSHM_TILE_SIZE;
+            continue;
+        }
+
+        rects[n].x = tx * WLSHM_TILE_SIZE;
+        rects[n].y = ty * WLSHM_TILE_SIZE;
+        rects[n].width = WLSHM_TILE_SIZE;
+        rects[n].height = WLSHM_TILE_SIZE;
+        n++;
+    }
+
+    if (same == 0) {
+        free(rects);
+        return 0;
+    }
+
+    changed = RegionFromRects(n, rects, CT_YXBANDED);
+    free(rects);
+    if (!changed)
+        return 0;
+
+    before = wlshm_region_area(damage);
+    RegionIntersect(damage, damage, changed);
+    RegionDestroy(changed);
+
+    return before - wlshm_region_area(damage);
+}
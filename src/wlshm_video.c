@@ -0,0 +1,353 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+#include "fourcc.h"
+
+/*
+ * A textured-style Xv adaptor: PutImage converts YUV straight into the
+ * window pixmap, which is the shm buffer itself unless back buffered,
+ * so players don't have to convert to RGB and push it through PutImage
+ * again.  Scaling is nearest neighbour, conversion is BT.601 limited
+ * range to x8r8g8b8, and only clipBoxes is touched.  The conversion
+ * itself is in wlshm_yuv.c.
+ */
+
+#ifndef FOURCC_NV12
+#define FOURCC_NV12	0x3231564e
+#define XVIMAGE_NV12 \
+   { \
+	FOURCC_NV12, \
+        XvYUV, \
+	LSBFirst, \
+	{'N','V','1','2', \
+	  0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+	12, \
+	XvPlanar, \
+	2, \
+	0, 0, 0, 0, \
+	8, 8, 8, \
+	1, 2, 2, \
+	1, 2, 2, \
+	{'Y','U','V', \
+	  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+	XvTopToBottom \
+   }
+#endif
+
+#define WLSHM_VIDEO_MAX_WIDTH	4096
+#define WLSHM_VIDEO_MAX_HEIGHT	4096
+#define WLSHM_VIDEO_NUM_PORTS	16
+
+/* Frames smaller than this (in pixels) aren't worth waking threads for */
+#define WLSHM_VIDEO_THREAD_THRESHOLD	(256 * 1024)
+#define WLSHM_VIDEO_THREAD_MIN_ROWS	16
+
+static XF86VideoEncodingRec wlshm_video_encodings[] = {
+    { 0, "XV_IMAGE", WLSHM_VIDEO_MAX_WIDTH, WLSHM_VIDEO_MAX_HEIGHT, { 1, 1 } },
+};
+
+static XF86VideoFormatRec wlshm_video_formats[] = {
+    { 24, TrueColor },
+};
+
+static XF86ImageRec wlshm_video_images[] = {
+    XVIMAGE_YUY2,
+    XVIMAGE_YV12,
+    XVIMAGE_I420,
+    XVIMAGE_NV12,
+};
+
+static int
+wlshm_video_query_image_attributes(ScrnInfoPtr pScrn, int id,
+                                   unsigned short *w, unsigned short *h,
+                                   int *pitches, int *offsets)
+{
+    int size, tmp;
+
+    if (*w > WLSHM_VIDEO_MAX_WIDTH)
+        *w = WLSHM_VIDEO_MAX_WIDTH;
+    if (*h > WLSHM_VIDEO_MAX_HEIGHT)
+        *h = WLSHM_VIDEO_MAX_HEIGHT;
+
+    *w = (*w + 1) & ~1;
+    if (offsets)
+        offsets[0] = 0;
+
+    switch (id) {
+    case FOURCC_YV12:
+    case FOURCC_I420:
+        *h = (*h + 1) & ~1;
+        size = (*w + 3) & ~3;
+        if (pitches)
+            pitches[0] = size;
+        size *= *h;
+        if (offsets)
+            offsets[1] = size;
+        tmp = ((*w >> 1) + 3) & ~3;
+        if (pitches)
+            pitches[1] = pitches[2] = tmp;
+        tmp *= (*h >> 1);
+        size += tmp;
+        if (offsets)
+            offsets[2] = size;
+        size += tmp;
+        break;
+    case FOURCC_NV12:
+        *h = (*h + 1) & ~1;
+        size = (*w + 3) & ~3;
+        if (pitches)
+            pitches[0] = pitches[1] = size;
+        size *= *h;
+        if (offsets)
+            offsets[1] = size;
+        size += ((*w + 3) & ~3) * (*h >> 1);
+        break;
+    case FOURCC_YUY2:
+    default:
+        size = *w << 1;
+        if (pitches)
+            pitches[0] = size;
+        size *= *h;
+        break;
+    }
+
+    return size;
+}
+
+
+static int
+wlshm_video_put_image(ScrnInfoPtr pScrn,
+                      short src_x, short src_y, short drw_x, short drw_y,
+                      short src_w, short src_h, short drw_w, short drw_h,
+                      int id, unsigned char *buf, short width, short height,
+                      Bool sync, RegionPtr clipBoxes, pointer data,
+                      DrawablePtr pDraw)
+{
+    struct wlshm_device *wlshm = data;
+    struct wlshm_yuv_job job;
+    unsigned short w = width, h = height;
+    int offsets[3], bands, n;
+    INT32 x1, x2, y1, y2;
+    PixmapPtr pixmap;
+    BoxRec dstBox;
+    BoxPtr box;
+
+    if (src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0)
+        return Success;
+
+    /*
+     * Clip the source to the image, scaling the destination along, so
+     * the kernels never sample outside buf.  Source coordinates come
+     * back in 16.16.
+     */
+    x1 = src_x;
+    x2 = src_x + src_w;
+    y1 = src_y;
+    y2 = src_y + src_h;
+    dstBox.x1 = drw_x;
+    dstBox.x2 = drw_x + drw_w;
+    dstBox.y1 = drw_y;
+    dstBox.y2 = drw_y + drw_h;
+    if (!xf86XVClipVideoHelper(&dstBox, &x1, &x2, &y1, &y2, clipBoxes,
+                               width, height))
+        return Success;
+    if (dstBox.x1 >= dstBox.x2 || dstBox.y1 >= dstBox.y2)
+        return Success;
+
+    if (pDraw->type == DRAWABLE_WINDOW)
+        pixmap = pDraw->pScreen->GetWindowPixmap((WindowPtr)pDraw);
+    else
+        pixmap = (PixmapPtr)pDraw;
+    if (pixmap->drawable.bitsPerPixel != 32 || !pixmap->devPrivate.ptr)
+        return BadMatch;
+
+    wlshm_video_query_image_attributes(pScrn, id, &w, &h,
+                                       job.pitches, offsets);
+    job.planes[0] = buf + offsets[0];
+    switch (id) {
+    case FOURCC_YV12:
+        job.format = WLSHM_YUV_PLANAR;
+        job.planes[1] = buf + offsets[2];
+        job.planes[2] = buf + offsets[1];
+        break;
+    case FOURCC_I420:
+        job.format = WLSHM_YUV_PLANAR;
+        job.planes[1] = buf + offsets[1];
+        job.planes[2] = buf + offsets[2];
+        break;
+    case FOURCC_NV12:
+        job.format = WLSHM_YUV_NV12;
+        job.planes[1] = buf + offsets[1];
+        break;
+    default:
+        job.format = WLSHM_YUV_YUY2;
+        break;
+    }
+
+    /* Rounding the steps down keeps the last sample short of x2 and y2 */
+    job.sx_step = (x2 - x1) / (dstBox.x2 - dstBox.x1);
+    job.sy_step = (y2 - y1) / (dstBox.y2 - dstBox.y1);
+    job.sx0 = x1 + job.sx_step / 2;
+    job.sy0 = y1 + job.sy_step / 2;
+    job.drw_x = dstBox.x1;
+    job.drw_y = dstBox.y1;
+#ifdef COMPOSITE
+    job.drw_x -= pixmap->screen_x;
+    job.drw_y -= pixmap->screen_y;
+#endif
+    job.dst = pixmap->devPrivate.ptr;
+    job.dst_stride = pixmap->devKind;
+
+    box = RegionRects(clipBoxes);
+    n = RegionNumRects(clipBoxes);
+    for (; n--; box++) {
+        job.box = *box;
+#ifdef COMPOSITE
+        job.box.x1 -= pixmap->screen_x;
+        job.box.x2 -= pixmap->screen_x;
+        job.box.y1 -= pixmap->screen_y;
+        job.box.y2 -= pixmap->screen_y;
+#endif
+        job.box.x1 = max(job.box.x1, 0);
+        job.box.y1 = max(job.box.y1, 0);
+        job.box.x2 = min(job.box.x2, pixmap->drawable.width);
+        job.box.y2 = min(job.box.y2, pixmap->drawable.height);
+        if (job.box.x1 >= job.box.x2 || job.box.y1 >= job.box.y2)
+            continue;
+
+        bands = 1;
+        if (wlshm->threads.count > 0 &&
+            (job.box.x2 - job.box.x1) * (job.box.y2 - job.box.y1) >=
+            WLSHM_VIDEO_THREAD_THRESHOLD)
+            bands = min(wlshm->threads.count + 1,
+                        (job.box.y2 - job.box.y1) /
+                        WLSHM_VIDEO_THREAD_MIN_ROWS);
+        wlshm_threads_run(&wlshm->threads, max(bands, 1),
+                          wlshm_yuv_band, &job);
+    }
+
+    DamageDamageRegion(pDraw, clipBoxes);
+    wlshm->stats.video_frames++;
+
+    return Success;
+}
+
+static void
+wlshm_video_stop_video(ScrnInfoPtr pScrn, pointer data, Bool shutdown)
+{
+}
+
+static int
+wlshm_video_set_port_attribute(ScrnInfoPtr pScrn, Atom attribute,
+                               INT32 value, pointer data)
+{
+    return BadMatch;
+}
+
+static int
+wlshm_video_get_port_attribute(ScrnInfoPtr pScrn, Atom attribute,
+                               INT32 *value, pointer data)
+{
+    return BadMatch;
+}
+
+static void
+wlshm_video_query_best_size(ScrnInfoPtr pScrn, Bool motion,
+                            short vid_w, short vid_h,
+                            short drw_w, short drw_h,
+                            unsigned int *p_w, unsigned int *p_h,
+                            pointer data)
+{
+    *p_w = drw_w;
+    *p_h = drw_h;
+}
+
+void
+wlshm_video_screen_init(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    struct wlshm_device *wlshm = wlshm_scrninfo_priv(pScrn);
+    XF86VideoAdaptorPtr adaptor, *adaptors, *new_adaptors;
+    int i, num_adaptors;
+
+    /* The kernels only write x8r8g8b8 */
+    if (pScrn->bitsPerPixel != 32 || pScrn->mask.red != 0xff0000 ||
+        pScrn->mask.blue != 0xff)
+        return;
+
+    adaptor = xf86XVAllocateVideoAdaptorRec(pScrn);
+    if (!adaptor)
+        return;
+
+    adaptor->pPortPrivates = calloc(WLSHM_VIDEO_NUM_PORTS, sizeof(DevUnion));
+    if (!adaptor->pPortPrivates) {
+        xf86XVFreeVideoAdaptorRec(adaptor);
+        return;
+    }
+
+    adaptor->type = XvWindowMask | XvInputMask | XvImageMask;
+    adaptor->flags = 0;
+    adaptor->name = "Wayland SHM Textured Video";
+    adaptor->nEncodings =
+        sizeof(wlshm_video_encodings) / sizeof(wlshm_video_encodings[0]);
+    adaptor->pEncodings = wlshm_video_encodings;
+    adaptor->nFormats =
+        sizeof(wlshm_video_formats) / sizeof(wlshm_video_formats[0]);
+    adaptor->pFormats = wlshm_video_formats;
+    adaptor->nPorts = WLSHM_VIDEO_NUM_PORTS;
+    for (i = 0; i < WLSHM_VIDEO_NUM_PORTS; i++)
+        adaptor->pPortPrivates[i].ptr = wlshm;
+    adaptor->nAttributes = 0;
+    adaptor->pAttributes = NULL;
+    adaptor->nImages =
+        sizeof(wlshm_video_images) / sizeof(wlshm_video_images[0]);
+    adaptor->pImages = wlshm_video_images;
+    adaptor->PutVideo = NULL;
+    adaptor->PutStill = NULL;
+    adaptor->GetVideo = NULL;
+    adaptor->GetStill = NULL;
+    adaptor->StopVideo = wlshm_video_stop_video;
+    adaptor->SetPortAttribute = wlshm_video_set_port_attribute;
+    adaptor->GetPortAttribute = wlshm_video_get_port_attribute;
+    adaptor->QueryBestSize = wlshm_video_query_best_size;
+    adaptor->PutImage = wlshm_video_put_image;
+    adaptor->QueryImageAttributes = wlshm_video_query_image_attributes;
+
+    num_adaptors = xf86XVListGenericAdaptors(pScrn, &adaptors);
+    new_adaptors = malloc((num_adaptors + 1) * sizeof(*new_adaptors));
+    if (!new_adaptors) {
+        free(adaptor->pPortPrivates);
+        xf86XVFreeVideoAdaptorRec(adaptor);
+        return;
+    }
+    if (num_adaptors)
+        memcpy(new_adaptors, adaptors, num_adaptors * sizeof(*new_adaptors));
+    new_adaptors[num_adaptors++] = adaptor;
+
+    if (xf86XVScreenInit(pScreen, new_adaptors, num_adaptors)) {
+        wlshm->video_adaptor = adaptor;
+        xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+                   "Xv adaptor enabled, %s YUV conversion\n",
+                   wlshm_yuv_kernel_name());
+    } else {
+        free(adaptor->pPortPrivates);
+        xf86XVFreeVideoAdaptorRec(adaptor);
+    }
+
+    free(new_adaptors);
+}
+
+void
+wlshm_video_screen_fini(ScreenPtr pScreen)
+{
+    struct wlshm_device *wlshm = wlshm_screen_priv(pScreen);
+
+    if (!wlshm->video_adaptor)
+        return;
+
+    free(wlshm->video_adaptor->pPortPrivates);
+    xf86XVFreeVideoAdaptorRec(wlshm->video_adaptor);
+    wlshm->video_adaptor = NULL;
+}
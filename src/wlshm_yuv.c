@@ -0,0 +1,358 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define WLSHM_YUV_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * YUV to x8r8g8b8 conversion for the Xv adaptor, see wlshm_video.c.
+ * Nothing in here touches server structures, so make check can hold
+ * the kernels against each other and against the formula below.
+ */
+
+/* Rows are converted this many pixels at a time */
+#define WLSHM_YUV_ROW_MAX	4096
+
+/*
+ * Convert one row of YUV to x8r8g8b8.  With a chroma shift of 1 u and v
+ * hold one sample per pixel pair (4:2:2), with 0 one per pixel (4:4:4),
+ * which is what wlshm_yuv_fetch_row() produces.  Inputs are clamped to
+ * the nominal range first, which keeps every intermediate within 16
+ * bits:
+ *
+ *   R = (149 Y' + 204 V'              + 64) >> 7
+ *   G = (149 Y' -  50 U' - 104 V'     + 64) >> 7
+ *   B = (149 Y' + 258 U'              + 64) >> 7
+ *
+ * with Y' = Y - 16, U' = U - 128, V' = V - 128.
+ */
+typedef void (*wlshm_yuv_row_proc)(uint32_t *dst, const uint8_t *y,
+                                   const uint8_t *u, const uint8_t *v,
+                                   int width, int shift);
+
+static inline int
+wlshm_clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static inline uint32_t
+wlshm_yuv_pixel(int y, int u, int v)
+{
+    int c = (wlshm_clamp(y, 16, 235) - 16) * 149 + 64;
+    int d = wlshm_clamp(u, 16, 240) - 128;
+    int e = wlshm_clamp(v, 16, 240) - 128;
+    int r = wlshm_clamp((c + 204 * e) >> 7, 0, 255);
+    int g = wlshm_clamp((c - 50 * d - 104 * e) >> 7, 0, 255);
+    int b = wlshm_clamp((c + 258 * d) >> 7, 0, 255);
+
+    return 0xff000000 | r << 16 | g << 8 | b;
+}
+
+static void
+wlshm_yuv_row_c(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                const uint8_t *v, int width, int shift)
+{
+    int x;
+
+    for (x = 0; x < width; x++)
+        dst[x] = wlshm_yuv_pixel(y[x], u[x >> shift], v[x >> shift]);
+}
+
+#ifdef WLSHM_YUV_X86
+
+__attribute__((target("sse2")))
+static inline void
+wlshm_yuv_8_sse2(__m128i y, __m128i u, __m128i v,
+                 __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i c, d, e;
+
+    c = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y, _mm_set1_epi16(16)),
+                                      _mm_set1_epi16(149)),
+                      _mm_set1_epi16(64));
+    d = _mm_sub_epi16(u, _mm_set1_epi16(128));
+    e = _mm_sub_epi16(v, _mm_set1_epi16(128));
+
+    *r = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(
+                                           e, _mm_set1_epi16(204))), 7);
+    *g = _mm_srai_epi16(_mm_subs_epi16(c, _mm_add_epi16(
+                            _mm_mullo_epi16(d, _mm_set1_epi16(50)),
+                            _mm_mullo_epi16(e, _mm_set1_epi16(104)))), 7);
+    *b = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(
+                                           d, _mm_set1_epi16(258))), 7);
+}
+
+__attribute__((target("sse2")))
+static void
+wlshm_yuv_row_sse2(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                   const uint8_t *v, int width, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi8((char)0xff);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i yy, uu, vv, r0, g0, b0, r1, g1, b1, r, g, b, bg, ra;
+
+        yy = _mm_loadu_si128((const __m128i *)(y + x));
+        if (shift) {
+            /* One chroma sample per pixel pair */
+            uu = _mm_loadl_epi64((const __m128i *)(u + x / 2));
+            vv = _mm_loadl_epi64((const __m128i *)(v + x / 2));
+            uu = _mm_unpacklo_epi8(uu, uu);
+            vv = _mm_unpacklo_epi8(vv, vv);
+        } else {
+            uu = _mm_loadu_si128((const __m128i *)(u + x));
+            vv = _mm_loadu_si128((const __m128i *)(v + x));
+        }
+
+        yy = _mm_min_epu8(_mm_max_epu8(yy, _mm_set1_epi8(16)),
+                          _mm_set1_epi8((char)235));
+        uu = _mm_min_epu8(_mm_max_epu8(uu, _mm_set1_epi8(16)),
+                          _mm_set1_epi8((char)240));
+        vv = _mm_min_epu8(_mm_max_epu8(vv, _mm_set1_epi8(16)),
+                          _mm_set1_epi8((char)240));
+
+        wlshm_yuv_8_sse2(_mm_unpacklo_epi8(yy, zero),
+                         _mm_unpacklo_epi8(uu, zero),
+                         _mm_unpacklo_epi8(vv, zero), &r0, &g0, &b0);
+        wlshm_yuv_8_sse2(_mm_unpackhi_epi8(yy, zero),
+                         _mm_unpackhi_epi8(uu, zero),
+                         _mm_unpackhi_epi8(vv, zero), &r1, &g1, &b1);
+
+        r = _mm_packus_epi16(r0, r1);
+        g = _mm_packus_epi16(g0, g1);
+        b = _mm_packus_epi16(b0, b1);
+
+        bg = _mm_unpacklo_epi8(b, g);
+        ra = _mm_unpacklo_epi8(r, alpha);
+        _mm_storeu_si128((__m128i *)(dst + x + 0), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_unpackhi_epi16(bg, ra));
+        bg = _mm_unpackhi_epi8(b, g);
+        ra = _mm_unpackhi_epi8(r, alpha);
+        _mm_storeu_si128((__m128i *)(dst + x + 8), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dst + x + 12), _mm_unpackhi_epi16(bg, ra));
+    }
+
+    wlshm_yuv_row_c(dst + x, y + x, u + (x >> shift), v + (x >> shift),
+                    width - x, shift);
+}
+
+__attribute__((target("avx2")))
+static void
+wlshm_yuv_row_avx2(uint32_t *dst, const uint8_t *y, const uint8_t *u,
+                   const uint8_t *v, int width, int shift)
+{
+    const __m256i ff = _mm256_set1_epi16(0xff);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m128i y8, u8, v8;
+        __m256i yy, uu, vv, c, d, e, r, g, b, bg, ra, lo, hi;
+
+        y8 = _mm_loadu_si128((const __m128i *)(y + x));
+        if (shift) {
+            u8 = _mm_loadl_epi64((const __m128i *)(u + x / 2));
+            v8 = _mm_loadl_epi64((const __m128i *)(v + x / 2));
+            u8 = _mm_unpacklo_epi8(u8, u8);
+            v8 = _mm_unpacklo_epi8(v8, v8);
+        } else {
+            u8 = _mm_loadu_si128((const __m128i *)(u + x));
+            v8 = _mm_loadu_si128((const __m128i *)(v + x));
+        }
+
+        yy = _mm256_cvtepu8_epi16(y8);
+        uu = _mm256_cvtepu8_epi16(u8);
+        vv = _mm256_cvtepu8_epi16(v8);
+
+        yy = _mm256_min_epi16(_mm256_max_epi16(yy, _mm256_set1_epi16(16)),
+                              _mm256_set1_epi16(235));
+        uu = _mm256_min_epi16(_mm256_max_epi16(uu, _mm256_set1_epi16(16)),
+                              _mm256_set1_epi16(240));
+        vv = _mm256_min_epi16(_mm256_max_epi16(vv, _mm256_set1_epi16(16)),
+                              _mm256_set1_epi16(240));
+
+        c = _mm256_add_epi16(_mm256_mullo_epi16(
+                                 _mm256_sub_epi16(yy, _mm256_set1_epi16(16)),
+                                 _mm256_set1_epi16(149)),
+                             _mm256_set1_epi16(64));
+        d = _mm256_sub_epi16(uu, _mm256_set1_epi16(128));
+        e = _mm256_sub_epi16(vv, _mm256_set1_epi16(128));
+
+        r = _mm256_mullo_epi16(e, _mm256_set1_epi16(204));
+        r = _mm256_srai_epi16(_mm256_adds_epi16(c, r), 7);
+        g = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_set1_epi16(50)),
+                             _mm256_mullo_epi16(e, _mm256_set1_epi16(104)));
+        g = _mm256_srai_epi16(_mm256_subs_epi16(c, g), 7);
+        b = _mm256_mullo_epi16(d, _mm256_set1_epi16(258));
+        b = _mm256_srai_epi16(_mm256_adds_epi16(c, b), 7);
+
+        r = _mm256_min_epi16(_mm256_max_epi16(r, _mm256_setzero_si256()), ff);
+        g = _mm256_min_epi16(_mm256_max_epi16(g, _mm256_setzero_si256()), ff);
+        b = _mm256_min_epi16(_mm256_max_epi16(b, _mm256_setzero_si256()), ff);
+
+        /* 16 bit lanes of b | g << 8 and r | 0xff << 8, then interleave */
+        bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+        ra = _mm256_or_si256(r, _mm256_set1_epi16((short)0xff00));
+        lo = _mm256_unpacklo_epi16(bg, ra);
+        hi = _mm256_unpackhi_epi16(bg, ra);
+
+        _mm256_storeu_si256((__m256i *)(dst + x),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + x + 8),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    wlshm_yuv_row_c(dst + x, y + x, u + (x >> shift), v + (x >> shift),
+                    width - x, shift);
+}
+
+#endif
+
+static wlshm_yuv_row_proc wlshm_yuv_row = wlshm_yuv_row_c;
+static const char *wlshm_yuv_name = "C";
+
+static const struct {
+    const char *name;
+    wlshm_yuv_row_proc row;
+} wlshm_yuv_kernels[] = {
+    { "C", wlshm_yuv_row_c },
+#ifdef WLSHM_YUV_X86
+    { "SSE2", wlshm_yuv_row_sse2 },
+    { "AVX2", wlshm_yuv_row_avx2 },
+#endif
+};
+
+/* Index of the best kernel this CPU runs, every one before it runs too */
+static int wlshm_yuv_best;
+
+void
+wlshm_yuv_init(void)
+{
+#ifdef WLSHM_YUV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        wlshm_yuv_best = 2;
+    else if (__builtin_cpu_supports("sse2"))
+        wlshm_yuv_best = 1;
+#endif
+    wlshm_yuv_use_kernel(wlshm_yuv_best);
+}
+
+const char *
+wlshm_yuv_kernel_name(void)
+{
+    return wlshm_yuv_name;
+}
+
+/*
+ * Switch to the n-th kernel, C first, for holding them against each
+ * other.  Returns its name, or NULL if this CPU can't run it.
+ */
+const char *
+wlshm_yuv_use_kernel(int n)
+{
+    if (n < 0 || n > wlshm_yuv_best)
+        return NULL;
+
+    wlshm_yuv_row = wlshm_yuv_kernels[n].row;
+    wlshm_yuv_name = wlshm_yuv_kernels[n].name;
+
+    return wlshm_yuv_name;
+}
+
+
+/*
+ * Fetch one destination row's worth of samples, scaled horizontally.
+ * Chroma is taken per pixel from the pair sx falls in, so u and v come
+ * out 4:4:4 whatever the clip start and scale.
+ */
+static void
+wlshm_yuv_fetch_row(struct wlshm_yuv_job *job, int sy, int x1, int width,
+                    uint8_t *y, uint8_t *u, uint8_t *v)
+{
+    const uint8_t *src_y, *src_u, *src_v;
+    int64_t fx;
+    int i, sx;
+
+    fx = job->sx0 + (int64_t)(x1 - job->drw_x) * job->sx_step;
+
+    switch (job->format) {
+    case WLSHM_YUV_YUY2:
+        src_y = job->planes[0] + sy * job->pitches[0];
+        for (i = 0; i < width; i++, fx += job->sx_step) {
+            sx = fx >> 16;
+            y[i] = src_y[sx * 2];
+            u[i] = src_y[(sx & ~1) * 2 + 1];
+            v[i] = src_y[(sx & ~1) * 2 + 3];
+        }
+        break;
+    case WLSHM_YUV_NV12:
+        src_y = job->planes[0] + sy * job->pitches[0];
+        src_u = job->planes[1] + (sy >> 1) * job->pitches[1];
+        for (i = 0; i < width; i++, fx += job->sx_step) {
+            sx = fx >> 16;
+            y[i] = src_y[sx];
+            u[i] = src_u[sx & ~1];
+            v[i] = src_u[(sx & ~1) + 1];
+        }
+        break;
+    case WLSHM_YUV_PLANAR:
+        src_y = job->planes[0] + sy * job->pitches[0];
+        src_u = job->planes[1] + (sy >> 1) * job->pitches[1];
+        src_v = job->planes[2] + (sy >> 1) * job->pitches[2];
+        for (i = 0; i < width; i++, fx += job->sx_step) {
+            sx = fx >> 16;
+            y[i] = src_y[sx];
+            u[i] = src_u[sx >> 1];
+            v[i] = src_v[sx >> 1];
+        }
+        break;
+    }
+}
+
+/* Convert a band of job->box, a wlshm_band_proc */
+void
+wlshm_yuv_band(void *arg, int band, int bands)
+{
+    struct wlshm_yuv_job *job = arg;
+    int height = job->box.y2 - job->box.y1;
+    int y1 = job->box.y1 + height * band / bands;
+    int y2 = job->box.y1 + height * (band + 1) / bands;
+    uint8_t y[WLSHM_YUV_ROW_MAX];
+    uint8_t u[WLSHM_YUV_ROW_MAX], v[WLSHM_YUV_ROW_MAX];
+    int py, sy, sx, x1, width;
+    uint32_t *dst;
+
+    for (py = y1; py < y2; py++) {
+        sy = (job->sy0 + (int64_t)(py - job->drw_y) * job->sy_step) >> 16;
+
+        for (x1 = job->box.x1; x1 < job->box.x2; x1 += width) {
+            width = min(job->box.x2 - x1, WLSHM_YUV_ROW_MAX);
+            dst = (uint32_t *)(job->dst + py * job->dst_stride) + x1;
+            sx = (job->sx0 + (int64_t)(x1 - job->drw_x) * job->sx_step) >> 16;
+
+            /* Unscaled planar rows starting on a chroma pair need no copy */
+            if (job->sx_step == 1 << 16 && !(sx & 1) &&
+                job->format == WLSHM_YUV_PLANAR) {
+                wlshm_yuv_row(dst,
+                              job->planes[0] + sy * job->pitches[0] + sx,
+                              job->planes[1] + (sy >> 1) * job->pitches[1] +
+                              sx / 2,
+                              job->planes[2] + (sy >> 1) * job->pitches[2] +
+                              sx / 2,
+                              width, 1);
+                continue;
+            }
+
+            wlshm_yuv_fetch_row(job, sy, x1, width, y, u, v);
+            wlshm_yuv_row(dst, y, u, v, width, 0);
+        }
+    }
+}
@@ -0,0 +1,425 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wlshm_test.h"
+
+/*
+ * The server functions the buffer code calls.  Log messages go to
+ * stderr when WLSHM_TEST_VERBOSE is set, and time only moves when a
+ * test moves it.
+ */
+
+ScrnInfoPtr *xf86Screens;
+
+CARD32 wlshm_test_time;
+
+static void
+wlshm_test_vmsg(MessageType type, int verb, const char *format, va_list args)
+{
+    static int verbose = -1;
+
+    if (verbose < 0) {
+        const char *env = getenv("WLSHM_TEST_VERBOSE");
+
+        verbose = env ? atoi(env) : 0;
+    }
+
+    if (type == X_ERROR || verb <= verbose) {
+        fprintf(stderr, "(%c) ", type == X_ERROR ? 'E' :
+                type == X_WARNING ? 'W' : 'I');
+        vfprintf(stderr, format, args);
+    }
+}
+
+void
+xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    wlshm_test_vmsg(type, 1, format, args);
+    va_end(args);
+}
+
+void
+xf86DrvMsgVerb(int scrnIndex, MessageType type, int verb,
+               const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    wlshm_test_vmsg(type, verb, format, args);
+    va_end(args);
+}
+
+CARD32
+GetTimeInMillis(void)
+{
+    return wlshm_test_time;
+}
+
+/* Timers only fire from wlshm_test_run_timers(), like from the main loop */
+struct _OsTimerRec {
+    CARD32 expires;
+    OsTimerCallback func;
+    pointer arg;
+};
+
+#define WLSHM_TEST_TIMERS	8
+
+static OsTimerPtr wlshm_test_timers[WLSHM_TEST_TIMERS];
+
+OsTimerPtr
+TimerSet(OsTimerPtr timer, int flags, CARD32 millis, OsTimerCallback func,
+         pointer arg)
+{
+    int i;
+
+    if (!timer) {
+        timer = calloc(1, sizeof(*timer));
+        if (!timer)
+            return NULL;
+        for (i = 0; i < WLSHM_TEST_TIMERS; i++) {
+            if (!wlshm_test_timers[i]) {
+                wlshm_test_timers[i] = timer;
+                break;
+            }
+        }
+    }
+
+    timer->expires = wlshm_test_time + millis;
+    timer->func = func;
+    timer->arg = arg;
+
+    return timer;
+}
+
+void
+TimerFree(OsTimerPtr timer)
+{
+    int i;
+
+    for (i = 0; i < WLSHM_TEST_TIMERS; i++)
+        if (wlshm_test_timers[i] == timer)
+            wlshm_test_timers[i] = NULL;
+    free(timer);
+}
+
+void
+wlshm_test_run_timers(void)
+{
+    OsTimerPtr timer;
+    OsTimerCallback func;
+    int i;
+
+    for (i = 0; i < WLSHM_TEST_TIMERS; i++) {
+        timer = wlshm_test_timers[i];
+        if (!timer || !timer->func ||
+            (int32_t)(wlshm_test_time - timer->expires) < 0)
+            continue;
+
+        func = timer->func;
+        timer->func = NULL;
+        (*func)(timer, wlshm_test_time, timer->arg);
+    }
+}
+
+Bool
+wlshm_test_wait_prep(struct wlshm_pool *pool)
+{
+    struct wlshm_buffer *buffer;
+    size_t ready;
+    int i, tries;
+
+    for (tries = 0; tries < 5000; tries++) {
+        pthread_mutex_lock(&pool->prep_lock);
+        ready = 0;
+        for (i = 0; i < WLSHM_POOL_NUM_CLASSES; i++)
+            xorg_list_for_each_entry(buffer, &pool->prep_ready[i], class_link)
+                ready += buffer->size;
+        pthread_mutex_unlock(&pool->prep_lock);
+
+        /* prep_bytes also counts what is asked for and being populated */
+        if (ready == wlshm_pool_prep_bytes(pool))
+            return TRUE;
+        usleep(1000);
+    }
+
+    return FALSE;
+}
+
+static int
+wlshm_test_compare_short(const void *a, const void *b)
+{
+    return *(const short *)a - *(const short *)b;
+}
+
+static int
+wlshm_test_compare_box_x(const void *a, const void *b)
+{
+    return ((const BoxRec *)a)->x1 - ((const BoxRec *)b)->x1;
+}
+
+/*
+ * Replace a region's boxes with the y-x banded, coalesced boxes covering
+ * the union of n boxes: bands split at every y where the spans covered
+ * change, spans within a band merged where they overlap or touch.
+ */
+static Bool
+wlshm_test_region_set(RegionPtr region, const BoxRec *boxes, int n)
+{
+    BoxPtr out = NULL, spans = NULL;
+    short *ys = NULL;
+    int i, k, nys = 0, nout = 0, nspans, prev = -1, prev_n = 0;
+
+    if (n > 0) {
+        ys = malloc(2 * n * sizeof(*ys));
+        spans = malloc(n * sizeof(*spans));
+        out = malloc(n * 2 * n * sizeof(*out));
+        if (!ys || !spans || !out) {
+            free(ys);
+            free(spans);
+            free(out);
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        if (boxes[i].x1 >= boxes[i].x2 || boxes[i].y1 >= boxes[i].y2)
+            continue;
+        ys[nys++] = boxes[i].y1;
+        ys[nys++] = boxes[i].y2;
+    }
+    if (nys)
+        qsort(ys, nys, sizeof(*ys), wlshm_test_compare_short);
+
+    for (k = 0; k + 1 < nys; k++) {
+        short y1 = ys[k], y2 = ys[k + 1];
+
+        if (y1 == y2)
+            continue;
+
+        nspans = 0;
+        for (i = 0; i < n; i++) {
+            if (boxes[i].x1 >= boxes[i].x2 ||
+                boxes[i].y1 > y1 || boxes[i].y2 < y2)
+                continue;
+            spans[nspans++] = boxes[i];
+        }
+        if (nspans == 0) {
+            prev = -1;
+            continue;
+        }
+        qsort(spans, nspans, sizeof(*spans), wlshm_test_compare_box_x);
+
+        /* Merge the spans into the band's boxes */
+        for (i = 0; i < nspans; i++) {
+            if (i > 0 && spans[i].x1 <= out[nout - 1].x2) {
+                out[nout - 1].x2 = max(out[nout - 1].x2, spans[i].x2);
+                continue;
+            }
+            out[nout].x1 = spans[i].x1;
+            out[nout].x2 = spans[i].x2;
+            out[nout].y1 = y1;
+            out[nout].y2 = y2;
+            nout++;
+        }
+
+        /* Coalesce with the band above if the spans are the same */
+        for (i = nout - 1; i >= 0 && out[i].y1 == y1; i--)
+            ;
+        i++;
+        if (prev >= 0 && prev_n == nout - i && out[prev].y2 == y1) {
+            int j;
+
+            for (j = 0; j < prev_n; j++)
+                if (out[prev + j].x1 != out[i + j].x1 ||
+                    out[prev + j].x2 != out[i + j].x2)
+                    break;
+            if (j == prev_n) {
+                for (j = 0; j < prev_n; j++)
+                    out[prev + j].y2 = y2;
+                nout = i;
+                continue;
+            }
+        }
+        prev = i;
+        prev_n = nout - i;
+    }
+
+    free(ys);
+    free(spans);
+    free(region->rects);
+
+    region->rects = out;
+    region->numRects = nout;
+    memset(&region->extents, 0, sizeof(region->extents));
+    for (i = 0; i < nout; i++) {
+        if (i == 0) {
+            region->extents = out[0];
+            continue;
+        }
+        region->extents.x1 = min(region->extents.x1, out[i].x1);
+        region->extents.x2 = max(region->extents.x2, out[i].x2);
+        region->extents.y2 = out[i].y2;
+    }
+
+    return TRUE;
+}
+
+void
+RegionInit(RegionPtr region, BoxPtr box, int size)
+{
+    region->rects = NULL;
+    region->numRects = 0;
+    memset(&region->extents, 0, sizeof(region->extents));
+    if (box)
+        wlshm_test_region_set(region, box, 1);
+}
+
+void
+RegionNull(RegionPtr region)
+{
+    RegionInit(region, NULL, 0);
+}
+
+void
+RegionUninit(RegionPtr region)
+{
+    free(region->rects);
+    RegionNull(region);
+}
+
+void
+RegionEmpty(RegionPtr region)
+{
+    RegionUninit(region);
+}
+
+RegionPtr
+RegionCreate(BoxPtr box, int size)
+{
+    RegionPtr region = malloc(sizeof(*region));
+
+    if (region)
+        RegionInit(region, box, size);
+
+    return region;
+}
+
+void
+RegionDestroy(RegionPtr region)
+{
+    RegionUninit(region);
+    free(region);
+}
+
+RegionPtr
+RegionFromRects(int nrects, xRectangle *rects, int ctype)
+{
+    RegionPtr region = RegionCreate(NULL, 0);
+    BoxPtr boxes;
+    int i;
+
+    if (!region)
+        return NULL;
+
+    boxes = malloc((nrects ? nrects : 1) * sizeof(*boxes));
+    if (!boxes) {
+        RegionDestroy(region);
+        return NULL;
+    }
+
+    for (i = 0; i < nrects; i++) {
+        boxes[i].x1 = rects[i].x;
+        boxes[i].y1 = rects[i].y;
+        boxes[i].x2 = rects[i].x + rects[i].width;
+        boxes[i].y2 = rects[i].y + rects[i].height;
+    }
+
+    wlshm_test_region_set(region, boxes, nrects);
+    free(boxes);
+
+    return region;
+}
+
+Bool
+RegionCopy(RegionPtr dst, RegionPtr src)
+{
+    if (dst == src)
+        return TRUE;
+
+    return wlshm_test_region_set(dst, src->rects, src->numRects);
+}
+
+Bool
+RegionUnion(RegionPtr dst, RegionPtr a, RegionPtr b)
+{
+    BoxPtr boxes = malloc((a->numRects + b->numRects + 1) * sizeof(*boxes));
+    Bool ret;
+
+    if (!boxes)
+        return FALSE;
+
+    /* An empty region may have no rects at all */
+    if (a->numRects)
+        memcpy(boxes, a->rects, a->numRects * sizeof(*boxes));
+    if (b->numRects)
+        memcpy(boxes + a->numRects, b->rects, b->numRects * sizeof(*boxes));
+    ret = wlshm_test_region_set(dst, boxes, a->numRects + b->numRects);
+    free(boxes);
+
+    return ret;
+}
+
+Bool
+RegionIntersect(RegionPtr dst, RegionPtr a, RegionPtr b)
+{
+    BoxPtr boxes = malloc((a->numRects * b->numRects + 1) * sizeof(*boxes));
+    int i, j, n = 0;
+    Bool ret;
+
+    if (!boxes)
+        return FALSE;
+
+    for (i = 0; i < a->numRects; i++) {
+        for (j = 0; j < b->numRects; j++) {
+            boxes[n].x1 = max(a->rects[i].x1, b->rects[j].x1);
+            boxes[n].y1 = max(a->rects[i].y1, b->rects[j].y1);
+            boxes[n].x2 = min(a->rects[i].x2, b->rects[j].x2);
+            boxes[n].y2 = min(a->rects[i].y2, b->rects[j].y2);
+            n++;
+        }
+    }
+
+    ret = wlshm_test_region_set(dst, boxes, n);
+    free(boxes);
+
+    return ret;
+}
+
+int
+RegionContainsRect(RegionPtr region, BoxPtr box)
+{
+    RegionRec tmp, part;
+    uint64_t area = 0, want;
+    int i;
+
+    RegionInit(&tmp, box, 1);
+    RegionNull(&part);
+    RegionIntersect(&part, region, &tmp);
+    for (i = 0; i < part.numRects; i++)
+        area += (uint64_t)(part.rects[i].x2 - part.rects[i].x1) *
+            (part.rects[i].y2 - part.rects[i].y1);
+    want = (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+    RegionUninit(&part);
+    RegionUninit(&tmp);
+
+    return area == 0 ? rgnOUT : area == want ? rgnIN : rgnPART;
+}
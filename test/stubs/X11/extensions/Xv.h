@@ -0,0 +1 @@
+/* Stand-in for the server's Xv.h, see xf86.h */
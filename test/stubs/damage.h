@@ -0,0 +1,10 @@
+#ifndef _WLSHM_TEST_DAMAGE_H_
+#define _WLSHM_TEST_DAMAGE_H_
+
+/* Stand-in for the server's damage.h, see xf86.h */
+
+#include "regionstr.h"
+
+typedef struct _damage *DamagePtr;
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _WLSHM_TEST_LIST_H_
+#define _WLSHM_TEST_LIST_H_
+
+/* The subset of the server's list.h the driver uses, see xf86.h */
+
+struct xorg_list {
+    struct xorg_list *next, *prev;
+};
+
+static inline void
+xorg_list_init(struct xorg_list *list)
+{
+    list->next = list->prev = list;
+}
+
+static inline void
+xorg_list_add(struct xorg_list *entry, struct xorg_list *head)
+{
+    head->next->prev = entry;
+    entry->next = head->next;
+    entry->prev = head;
+    head->next = entry;
+}
+
+static inline void
+xorg_list_del(struct xorg_list *entry)
+{
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    xorg_list_init(entry);
+}
+
+static inline int
+xorg_list_is_empty(struct xorg_list *head)
+{
+    return head->next == head;
+}
+
+#define xorg_list_entry(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define xorg_list_first_entry(ptr, type, member) \
+    xorg_list_entry((ptr)->next, type, member)
+
+#define xorg_list_last_entry(ptr, type, member) \
+    xorg_list_entry((ptr)->prev, type, member)
+
+#define xorg_list_for_each_entry(pos, head, member)                     \
+    for (pos = xorg_list_entry((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head);                                        \
+         pos = xorg_list_entry(pos->member.next, __typeof__(*pos), member))
+
+#define xorg_list_for_each_entry_safe(pos, tmp, head, member)           \
+    for (pos = xorg_list_entry((head)->next, __typeof__(*pos), member), \
+         tmp = xorg_list_entry(pos->member.next, __typeof__(*pos), member); \
+         &pos->member != (head);                                        \
+         pos = tmp,                                                     \
+         tmp = xorg_list_entry(pos->member.next, __typeof__(*pos), member))
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _WLSHM_TEST_PICTURESTR_H_
+#define _WLSHM_TEST_PICTURESTR_H_
+
+/* Stand-in for the server's picturestr.h, see xf86.h */
+
+#include <pixman.h>
+
+typedef void (*CompositeProcPtr)(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _WLSHM_TEST_PIXMAPSTR_H_
+#define _WLSHM_TEST_PIXMAPSTR_H_
+
+/* Stand-in for the server's pixmapstr.h, see xf86.h */
+
+typedef struct _Drawable {
+    unsigned char depth;
+    unsigned char bitsPerPixel;
+    short x, y;
+    unsigned short width, height;
+    ScreenPtr pScreen;
+} DrawableRec, *DrawablePtr;
+
+typedef union _DevUnion {
+    pointer ptr;
+    long val;
+    unsigned long uval;
+    pointer fptr;
+} DevUnion;
+
+typedef struct _Pixmap {
+    DrawableRec drawable;
+    int devKind;
+    DevUnion devPrivate;
+} PixmapRec;
+
+#endif
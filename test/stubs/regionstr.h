@@ -0,0 +1,72 @@
+#ifndef _WLSHM_TEST_REGIONSTR_H_
+#define _WLSHM_TEST_REGIONSTR_H_
+
+/*
+ * Stand-in for the server's regionstr.h, see xf86.h.  Regions are kept
+ * as a plain array of boxes, put in the same y-x banded form pixman
+ * uses after every operation, so rectangle counts come out the same.
+ */
+
+typedef struct _Box {
+    short x1, y1, x2, y2;
+} BoxRec, *BoxPtr;
+
+typedef struct _Region {
+    BoxRec extents;
+    int numRects;
+    BoxPtr rects;
+} RegionRec, *RegionPtr;
+
+/* From Xproto.h */
+typedef struct {
+    short x, y;
+    unsigned short width, height;
+} xRectangle;
+
+#define rgnOUT	0
+#define rgnIN	1
+#define rgnPART	2
+
+#define CT_NONE		0
+#define CT_UNSORTED	6
+#define CT_YSORTED	7
+#define CT_YXSORTED	8
+#define CT_YXBANDED	9
+
+void RegionInit(RegionPtr region, BoxPtr box, int size);
+void RegionNull(RegionPtr region);
+void RegionUninit(RegionPtr region);
+void RegionEmpty(RegionPtr region);
+RegionPtr RegionCreate(BoxPtr box, int size);
+void RegionDestroy(RegionPtr region);
+RegionPtr RegionFromRects(int nrects, xRectangle *rects, int ctype);
+Bool RegionCopy(RegionPtr dst, RegionPtr src);
+Bool RegionUnion(RegionPtr dst, RegionPtr a, RegionPtr b);
+Bool RegionIntersect(RegionPtr dst, RegionPtr a, RegionPtr b);
+int RegionContainsRect(RegionPtr region, BoxPtr box);
+
+static inline BoxPtr
+RegionExtents(RegionPtr region)
+{
+    return &region->extents;
+}
+
+static inline int
+RegionNumRects(RegionPtr region)
+{
+    return region->numRects;
+}
+
+static inline BoxPtr
+RegionRects(RegionPtr region)
+{
+    return region->rects;
+}
+
+static inline Bool
+RegionNotEmpty(RegionPtr region)
+{
+    return region->numRects > 0;
+}
+
+#endif
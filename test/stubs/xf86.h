@@ -0,0 +1,79 @@
+#ifndef _WLSHM_TEST_XF86_H_
+#define _WLSHM_TEST_XF86_H_
+
+/*
+ * Just enough of the server's headers to build the parts of the driver
+ * that only deal in memory (the buffer pool, the copy kernels, the
+ * worker threads) into a standalone program.  Types the driver only
+ * passes around by pointer are left incomplete.  Keep this in step
+ * with what wlshm.h pulls in.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef int Bool;
+typedef void *pointer;
+typedef uint32_t CARD32;
+typedef uint16_t CARD16;
+typedef uint8_t CARD8;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+typedef enum {
+    X_PROBED,
+    X_CONFIG,
+    X_DEFAULT,
+    X_CMDLINE,
+    X_NOTICE,
+    X_ERROR,
+    X_WARNING,
+    X_INFO,
+    X_NONE,
+    X_NOT_IMPLEMENTED,
+} MessageType;
+
+typedef struct _ScrnInfoRec {
+    int scrnIndex;
+    pointer driverPrivate;
+} ScrnInfoRec, *ScrnInfoPtr;
+
+typedef struct _Screen {
+    int myNum;
+} ScreenRec, *ScreenPtr;
+
+extern ScrnInfoPtr *xf86Screens;
+
+typedef struct _Pixmap *PixmapPtr;
+typedef struct _Window *WindowPtr;
+typedef struct _DGAMode *DGAModePtr;
+typedef struct _OptionInfoRec *OptionInfoPtr;
+typedef struct _OsTimerRec *OsTimerPtr;
+
+typedef Bool (*CloseScreenProcPtr)(int, ScreenPtr);
+typedef Bool (*CreateGCProcPtr)(void *);
+typedef Bool (*CreateWindowProcPtr)(WindowPtr);
+typedef Bool (*DestroyWindowProcPtr)(WindowPtr);
+typedef Bool (*UnrealizeWindowProcPtr)(WindowPtr);
+typedef void (*SetWindowPixmapProcPtr)(WindowPtr, PixmapPtr);
+typedef CARD32 (*OsTimerCallback)(OsTimerPtr, CARD32, pointer);
+
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+
+#include "pixmapstr.h"
+
+void xf86DrvMsg(int scrnIndex, MessageType type, const char *format, ...);
+void xf86DrvMsgVerb(int scrnIndex, MessageType type, int verb,
+                    const char *format, ...);
+
+CARD32 GetTimeInMillis(void);
+OsTimerPtr TimerSet(OsTimerPtr timer, int flags, CARD32 millis,
+                    OsTimerCallback func, pointer arg);
+void TimerFree(OsTimerPtr timer);
+
+#endif
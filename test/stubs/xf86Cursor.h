@@ -0,0 +1 @@
+/* Stand-in for the server's xf86Cursor.h, see xf86.h */
@@ -0,0 +1 @@
+/* Stand-in for the server's xf86_OSproc.h, see xf86.h */
@@ -0,0 +1,3 @@
+/* Stand-in for the server's xf86xv.h, see xf86.h */
+
+typedef struct _XF86VideoAdaptorRec *XF86VideoAdaptorPtr;
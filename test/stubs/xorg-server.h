@@ -0,0 +1,6 @@
+/* Stand-in for the server's xorg-server.h, see xf86.h */
+
+/* Which, like the real one, turns on the glibc extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
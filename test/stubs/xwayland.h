@@ -0,0 +1 @@
+/* Stand-in for the server's xwayland.h, see xf86.h */
@@ -0,0 +1,398 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm_test.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Benchmarks for the buffer code, run by make bench.  Not part of make
+ * check: the numbers depend on the machine and only mean something
+ * next to each other.
+ *
+ * The pool is timed through a window's life: get a buffer, fill it
+ * with the window contents, copy them back out and put the buffer
+ * back, once recycled and once with pooling off, which is what the
+ * driver did before the pool.  A new window's first copy into shm is
+ * timed with and without the prep thread having populated its buffer
+ * ahead of time.  The copy kernels are timed against
+ * plain memcpy rows, the tile filter against the copy it saves, and
+ * damage simplification on scattered rectangles.
+ * Pass a number to scale the iteration counts.
+ */
+
+static ScrnInfoRec wlshm_bench_scrn;
+static int scale = 1;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, uint64_t *ns, int n, size_t bytes)
+{
+    uint64_t total = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        total += ns[i];
+    qsort(ns, n, sizeof(ns[0]), compare_u64);
+
+    printf("  %-28s p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  "
+           "%8.0f/s %7.2f GB/s\n", name,
+           ns[n / 2] / 1e3, ns[n * 9 / 10] / 1e3, ns[n * 99 / 100] / 1e3,
+           n * 1e9 / total, (double)bytes * n / total);
+}
+
+/* A window of width x height at 32 bpp coming and going */
+static void
+bench_pool_churn(struct wlshm_threads *threads, const char *what,
+                 int width, int height, int iterations)
+{
+    int stride = width * 4;
+    size_t size = (size_t)stride * height;
+    uint8_t *pixels = malloc(size);
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    struct wlshm_pool pool;
+    int pooled, i;
+
+    memset(pixels, 0x80, size);
+    printf("%s, %dx%d:\n", what, width, height);
+
+    for (pooled = 1; pooled >= 0; pooled--) {
+        wlshm_pool_init(&pool, &wlshm_bench_scrn,
+                        pooled ? WLSHM_POOL_DEFAULT_LIMIT : 0, FALSE, 0);
+
+        for (i = 0; i < iterations; i++) {
+            struct wlshm_buffer *buffer;
+            uint64_t start = now_ns();
+
+            buffer = wlshm_pool_get(&pool, size);
+            if (!buffer)
+                break;
+            wlshm_copy_rect(threads, buffer->data, stride, pixels, stride,
+                            stride, height, TRUE);
+            wlshm_copy_rect(threads, pixels, stride, buffer->data, stride,
+                            stride, height, FALSE);
+            wlshm_pool_put(&pool, buffer);
+            ns[i] = now_ns() - start;
+
+            /* Long enough for the buffer to come off screen */
+            wlshm_test_time += 1000;
+        }
+
+        if (i == iterations)
+            report(pooled ? "pooled" : "new buffer each time",
+                   ns, iterations, size * 2);
+        wlshm_pool_fini(&pool);
+    }
+
+    free(ns);
+    free(pixels);
+}
+
+/* A window being resized a few pixels at a time */
+static void
+bench_pool_resize(struct wlshm_threads *threads, int width, int height,
+                  int iterations)
+{
+    uint8_t *pixels = malloc((size_t)(width + iterations) * 4 *
+                             (height + iterations));
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    struct wlshm_pool pool;
+    size_t bytes = 0;
+    int pooled, i;
+
+    printf("interactive resize from %dx%d:\n", width, height);
+
+    for (pooled = 1; pooled >= 0; pooled--) {
+        struct wlshm_buffer *buffer = NULL;
+
+        wlshm_pool_init(&pool, &wlshm_bench_scrn,
+                        pooled ? WLSHM_POOL_DEFAULT_LIMIT : 0, FALSE, 0);
+
+        bytes = 0;
+        for (i = 0; i < iterations; i++) {
+            int w = width + (i % 64) * 2, h = height + (i % 64);
+            uint64_t start = now_ns();
+            struct wlshm_buffer *next;
+
+            next = wlshm_pool_get(&pool, (size_t)w * 4 * h);
+            if (!next)
+                break;
+            wlshm_copy_rect(threads, next->data, w * 4, pixels, w * 4,
+                            w * 4, h, TRUE);
+            if (buffer)
+                wlshm_pool_put(&pool, buffer);
+            buffer = next;
+            ns[i] = now_ns() - start;
+            bytes += (size_t)w * 4 * h;
+
+            /* One resize step per frame */
+            wlshm_test_time += 16;
+        }
+
+        if (buffer)
+            wlshm_pool_put(&pool, buffer);
+        if (i == iterations)
+            report(pooled ? "pooled" : "new buffer each time",
+                   ns, iterations, bytes / iterations);
+        wlshm_pool_fini(&pool);
+    }
+
+    free(ns);
+    free(pixels);
+}
+
+/* A new window's first frame, on a buffer the pool can't recycle */
+static void
+bench_prefault(struct wlshm_threads *threads, int width, int height,
+               int iterations)
+{
+    int stride = width * 4;
+    size_t size = (size_t)stride * height;
+    uint8_t *pixels = malloc(size);
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    struct wlshm_pool pool;
+    int prefault, i;
+
+    memset(pixels, 0x80, size);
+    printf("first frame of a new window, %dx%d:\n", width, height);
+
+    for (prefault = 1; prefault >= 0; prefault--) {
+        wlshm_pool_init(&pool, &wlshm_bench_scrn, 0, FALSE,
+                        prefault ? WLSHM_PREP_LIMIT : 0);
+        wlshm_pool_expect(&pool, size);
+
+        for (i = 0; i < iterations; i++) {
+            struct wlshm_buffer *buffer;
+            uint64_t start;
+
+            /* Windows don't come faster than the thread can keep up */
+            if (prefault && !wlshm_test_wait_prep(&pool))
+                break;
+
+            start = now_ns();
+            buffer = wlshm_pool_get(&pool, size);
+            if (!buffer)
+                break;
+            wlshm_copy_rect(threads, buffer->data, stride, pixels, stride,
+                            stride, height, TRUE);
+            ns[i] = now_ns() - start;
+            wlshm_pool_put(&pool, buffer);
+        }
+
+        if (i == iterations)
+            report(prefault ? "prefaulted" : "faulted on first copy",
+                   ns, iterations, size);
+        wlshm_pool_fini(&pool);
+    }
+
+    free(ns);
+    free(pixels);
+}
+
+static void
+memcpy_rows(uint8_t *dst, int dst_stride, const uint8_t *src, int src_stride,
+            int width, int height)
+{
+    while (height--) {
+        memcpy(dst, src, width);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+/* Copying a width x height window into shm */
+static void
+bench_copy(struct wlshm_threads *threads, int width, int height,
+           int iterations)
+{
+    int src_stride = (width * 4 + WLSHM_STRIDE_ALIGN - 1) &
+        ~(WLSHM_STRIDE_ALIGN - 1);
+    int dst_stride = width * 4;
+    uint8_t *src = malloc((size_t)src_stride * height);
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    struct wlshm_pool pool;
+    struct wlshm_buffer *buffer;
+    int i, run;
+
+    wlshm_pool_init(&pool, &wlshm_bench_scrn, 0, FALSE, 0);
+    buffer = wlshm_pool_get(&pool, (size_t)dst_stride * height);
+    if (!buffer || !src || !ns)
+        goto out;
+
+    memset(src, 0x80, (size_t)src_stride * height);
+    memset(buffer->data, 0, buffer->size);
+    printf("copy %dx%d to shm:\n", width, height);
+
+    for (run = 0; run < 3; run++) {
+        for (i = 0; i < iterations; i++) {
+            uint64_t start = now_ns();
+
+            if (run == 0)
+                memcpy_rows(buffer->data, dst_stride, src, src_stride,
+                            dst_stride, height);
+            else
+                wlshm_copy_rect(run == 2 ? threads : NULL,
+                                buffer->data, dst_stride, src, src_stride,
+                                dst_stride, height, TRUE);
+            ns[i] = now_ns() - start;
+        }
+        report(run == 0 ? "memcpy" :
+               run == 1 ? wlshm_copy_kernel_name() : "threaded",
+               ns, iterations, (size_t)dst_stride * height);
+    }
+
+out:
+    if (buffer)
+        wlshm_pool_put(&pool, buffer);
+    wlshm_pool_fini(&pool);
+    free(ns);
+    free(src);
+}
+
+/* A width x height window repainted with the same pixels */
+static void
+bench_tiles(struct wlshm_threads *threads, int width, int height,
+            int iterations)
+{
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    BoxRec box = { 0, 0, width, height };
+    struct wlshm_pixmap d;
+    PixmapRec pixmap;
+    RegionRec damage;
+    int i;
+
+    memset(&pixmap, 0, sizeof(pixmap));
+    pixmap.drawable.width = width;
+    pixmap.drawable.height = height;
+    pixmap.drawable.bitsPerPixel = 32;
+    pixmap.devKind = (width * 4 + WLSHM_STRIDE_ALIGN - 1) &
+        ~(WLSHM_STRIDE_ALIGN - 1);
+    pixmap.devPrivate.ptr = malloc((size_t)pixmap.devKind * height);
+    memset(pixmap.devPrivate.ptr, 0x80, (size_t)pixmap.devKind * height);
+
+    memset(&d, 0, sizeof(d));
+    d.pixmap = &pixmap;
+    if (!ns || !pixmap.devPrivate.ptr || !wlshm_tiles_attach(&d))
+        goto out;
+
+    printf("tile filter %dx%d, unchanged:\n", width, height);
+    for (i = 0; i < iterations; i++) {
+        uint64_t start;
+
+        RegionInit(&damage, &box, 1);
+        start = now_ns();
+        wlshm_tiles_filter(threads, &d, &damage);
+        ns[i] = now_ns() - start;
+        RegionUninit(&damage);
+    }
+    report(wlshm_tiles_kernel_name(), ns, iterations,
+           (size_t)width * 4 * height);
+
+out:
+    wlshm_tiles_detach(&d);
+    free(pixmap.devPrivate.ptr);
+    free(ns);
+}
+
+/* Text damage: count small rectangles scattered over a window */
+static void
+bench_damage(int count, int iterations)
+{
+    uint64_t *ns = calloc(iterations, sizeof(*ns));
+    uint64_t overdraw = 0;
+    RegionRec damage, out, tmp;
+    BoxRec box;
+    int i;
+
+    if (!ns)
+        return;
+
+    RegionNull(&damage);
+    srand(count);
+    for (i = 0; i < count; i++) {
+        box.x1 = rand() % 1900;
+        box.y1 = rand() % 1060;
+        box.x2 = box.x1 + 6 + rand() % 10;
+        box.y2 = box.y1 + 12 + rand() % 6;
+        RegionInit(&tmp, &box, 1);
+        RegionUnion(&damage, &damage, &tmp);
+        RegionUninit(&tmp);
+    }
+
+    printf("damage simplification, %d rectangles:\n",
+           (int)RegionNumRects(&damage));
+    for (i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+
+        if (wlshm_damage_reduce(&damage, &out, WLSHM_DAMAGE_DEFAULT_MAX_RECTS,
+                                WLSHM_DAMAGE_DEFAULT_RECT_COST, &overdraw))
+            RegionUninit(&out);
+        ns[i] = now_ns() - start;
+    }
+    report("greedy merge", ns, iterations, 0);
+
+    RegionUninit(&damage);
+    free(ns);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct wlshm_threads threads;
+
+    if (argc > 1 && atoi(argv[1]) > 0)
+        scale = atoi(argv[1]);
+
+    wlshm_copy_init();
+    wlshm_tiles_init();
+    if (!wlshm_threads_init(&threads, &wlshm_bench_scrn,
+                            WLSHM_DEFAULT_THREADS))
+        return 1;
+    printf("%ld CPUs, %d copy threads, %s copy kernel, %s tile hash\n\n",
+           sysconf(_SC_NPROCESSORS_ONLN), threads.count,
+           wlshm_copy_kernel_name(), wlshm_tiles_kernel_name());
+
+    bench_pool_churn(&threads, "tooltip", 200, 40, 2000 * scale);
+    bench_pool_churn(&threads, "menu", 300, 500, 1000 * scale);
+    bench_pool_churn(&threads, "dialog", 800, 600, 500 * scale);
+    bench_pool_churn(&threads, "maximised window", 1920, 1080, 100 * scale);
+    bench_pool_churn(&threads, "maximised window", 3840, 2160, 50 * scale);
+    bench_pool_resize(&threads, 800, 600, 256 * scale);
+    bench_prefault(&threads, 1920, 1080, 50 * scale);
+    bench_prefault(&threads, 3840, 2160, 20 * scale);
+
+    bench_copy(&threads, 1920, 1080, 100 * scale);
+    bench_copy(&threads, 2560, 1440, 100 * scale);
+    bench_copy(&threads, 3840, 2160, 50 * scale);
+    bench_copy(&threads, 1366, 768, 200 * scale);
+    bench_copy(&threads, 1023, 767, 200 * scale);
+
+    bench_tiles(&threads, 1920, 1080, 100 * scale);
+    bench_tiles(&threads, 3840, 2160, 50 * scale);
+
+    bench_damage(32, 2000 * scale);
+    bench_damage(48, 500 * scale);
+
+    wlshm_threads_fini(&threads);
+
+    return 0;
+}
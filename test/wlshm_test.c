@@ -0,0 +1,944 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "wlshm_test.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+/*
+ * Checks for the parts of the driver that don't need a server: the shm
+ * buffer pool and memory budget, the copy, depth 30 and YUV conversion
+ * kernels, banded rendering, the tile filter and damage simplification.
+ * Run by make check.
+ */
+
+static ScrnInfoRec wlshm_test_scrn;
+static int failures;
+
+#define check(cond) do {                                                \
+    if (!(cond)) {                                                      \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n",                \
+                __FILE__, __LINE__, __func__, #cond);                   \
+        failures++;                                                     \
+    }                                                                   \
+} while (0)
+
+static void
+test_pool_size_classes(void)
+{
+    struct wlshm_pool pool;
+    struct wlshm_buffer *buffer;
+    static const struct {
+        size_t size, class_size;
+    } sizes[] = {
+        { 1, 64 << 10 },
+        { 64 << 10, 64 << 10 },
+        { (64 << 10) + 1, 80 << 10 },
+        { 100 << 10, 112 << 10 },
+        { 1920 * 1080 * 4, 8 << 20 },
+    };
+    int i;
+
+    wlshm_pool_init(&pool, &wlshm_test_scrn, WLSHM_POOL_DEFAULT_LIMIT,
+                    FALSE, 0);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        buffer = wlshm_pool_get(&pool, sizes[i].size);
+        check(buffer != NULL);
+        if (!buffer)
+            continue;
+        check(buffer->size == sizes[i].class_size);
+        check(buffer->size_class >= 0);
+        check(buffer->fd >= 0);
+        memset(buffer->data, 0xa5, buffer->size);
+        wlshm_pool_put(&pool, buffer);
+    }
+
+    /* Too big for any class, sized to the page and never kept */
+    buffer = wlshm_pool_get(&pool, (size_t)5 << 30);
+    if (buffer) {
+        unsigned long destroyed = pool.buffers_destroyed;
+
+        check(buffer->size_class < 0);
+        wlshm_pool_put(&pool, buffer);
+        check(pool.buffers_destroyed == destroyed + 1);
+    }
+
+    wlshm_pool_fini(&pool);
+    check(pool.buffers_created == pool.buffers_destroyed);
+    check(pool.mapped_bytes == 0);
+}
+
+static void
+test_pool_grace(void)
+{
+    struct wlshm_pool pool;
+    struct wlshm_buffer *a, *b, *c, *d;
+
+    wlshm_test_time = 5000;
+    wlshm_pool_init(&pool, &wlshm_test_scrn, WLSHM_POOL_DEFAULT_LIMIT,
+                    FALSE, 0);
+
+    a = wlshm_pool_get(&pool, 300 << 10);
+    wlshm_pool_put(&pool, a);
+
+    /* Still possibly on screen, so a second window gets a buffer of its own */
+    wlshm_test_time += 999;
+    b = wlshm_pool_get(&pool, 300 << 10);
+    check(b != a);
+    check(pool.buffers_created == 2);
+
+    wlshm_test_time += 1;
+    c = wlshm_pool_get(&pool, 300 << 10);
+    check(c == a);
+    check(pool.free_bytes == 0);
+
+    /* The oldest buffer of a class is handed out first */
+    wlshm_pool_put(&pool, b);
+    wlshm_test_time += 500;
+    wlshm_pool_put(&pool, c);
+    wlshm_test_time += 500;
+    check(wlshm_pool_get(&pool, 300 << 10) == b);
+    check(pool.buffers_created == 2);
+
+    /* Survives the clock wrapping */
+    wlshm_test_time = 0xffffff00;
+    wlshm_pool_put(&pool, b);
+    wlshm_test_time = 0x100;
+    check(wlshm_pool_get(&pool, 300 << 10) == c);
+    d = wlshm_pool_get(&pool, 300 << 10);
+    check(d != b);
+    check(pool.buffers_created == 3);
+    wlshm_test_time = 0x300;
+    check(wlshm_pool_get(&pool, 300 << 10) == b);
+
+    wlshm_pool_put(&pool, b);
+    wlshm_pool_put(&pool, c);
+    wlshm_pool_put(&pool, d);
+    wlshm_pool_fini(&pool);
+    check(pool.buffers_created == pool.buffers_destroyed);
+}
+
+static void
+test_pool_limit(void)
+{
+    struct wlshm_pool pool;
+    struct wlshm_buffer *a, *b, *c;
+
+    wlshm_test_time = 0;
+
+    /* No limit, no pool */
+    wlshm_pool_init(&pool, &wlshm_test_scrn, 0, FALSE, 0);
+    a = wlshm_pool_get(&pool, 1);
+    wlshm_pool_put(&pool, a);
+    check(pool.buffers_destroyed == 1);
+    check(pool.free_bytes == 0);
+    wlshm_pool_fini(&pool);
+
+    /* Room for two buffers, the least recently freed one goes */
+    wlshm_pool_init(&pool, &wlshm_test_scrn, 2 << 20, FALSE, 0);
+    a = wlshm_pool_get(&pool, 1 << 20);
+    b = wlshm_pool_get(&pool, 1 << 20);
+    c = wlshm_pool_get(&pool, 1 << 20);
+    wlshm_pool_put(&pool, a);
+    wlshm_pool_put(&pool, b);
+    check(pool.buffers_destroyed == 0);
+    wlshm_pool_put(&pool, c);
+    check(pool.buffers_destroyed == 1);
+    check(pool.free_bytes == 2 << 20);
+
+    wlshm_test_time += 1000;
+    a = wlshm_pool_get(&pool, 1 << 20);
+    check(a == b);
+    wlshm_pool_put(&pool, a);
+
+    /* Trimming for the memory budget goes in the same order */
+    wlshm_pool_trim(&pool, 1 << 20);
+    check(pool.buffers_destroyed == 2);
+    check(pool.free_bytes == 1 << 20);
+    wlshm_test_time += 1000;
+    check(wlshm_pool_get(&pool, 1 << 20) == b);
+    wlshm_pool_put(&pool, b);
+
+    wlshm_pool_fini(&pool);
+    check(pool.buffers_created == pool.buffers_destroyed);
+}
+
+static void
+test_pool_prep(void)
+{
+    struct wlshm_pool pool;
+    struct wlshm_buffer *a;
+
+    wlshm_test_time = 0;
+    wlshm_pool_init(&pool, &wlshm_test_scrn, WLSHM_POOL_DEFAULT_LIMIT,
+                    FALSE, 4 << 20);
+    check(pool.prep_running);
+    if (!pool.prep_running)
+        return;
+
+    /* Asked for up front, populated by the time a window needs it */
+    wlshm_pool_expect(&pool, 1 << 20);
+    check(wlshm_test_wait_prep(&pool));
+    a = wlshm_pool_get(&pool, 1 << 20);
+    check(pool.prep_hits == 1);
+    memset(a->data, 0, a->size);
+
+    /* A spare for the same size is on its way, and held to the limit */
+    check(wlshm_pool_prep_bytes(&pool) == 1 << 20);
+    check(wlshm_test_wait_prep(&pool));
+    wlshm_pool_expect(&pool, 3 << 20);
+    wlshm_pool_expect(&pool, 3 << 20);
+    check(wlshm_pool_prep_bytes(&pool) <= 4 << 20);
+
+    /* The memory budget can take them all back */
+    check(wlshm_test_wait_prep(&pool));
+    wlshm_pool_drop_prep(&pool, 0);
+    check(wlshm_pool_prep_bytes(&pool) == 0);
+
+    wlshm_pool_put(&pool, a);
+    wlshm_pool_fini(&pool);
+    check(pool.buffers_created == pool.buffers_destroyed);
+}
+
+/* What an unmapped window leaves on wlshm_device.retained */
+static struct wlshm_pixmap *
+test_budget_retain(struct wlshm_device *wlshm, PixmapPtr pixmap,
+                   Bool back_buffered)
+{
+    struct wlshm_pixmap *d = calloc(1, sizeof(*d));
+    int y;
+
+    d->pixmap = pixmap;
+    d->stride = pixmap->drawable.width * 4;
+    d->bytes = (size_t)d->stride * pixmap->drawable.height;
+    d->buffer = wlshm_pool_get(&wlshm->pool, d->bytes);
+    d->data = d->buffer->data;
+    d->back_buffered = back_buffered;
+
+    /* Something lz4 gets well under half of */
+    for (y = 0; y < pixmap->drawable.height; y++)
+        memset((uint8_t *)d->data + (size_t)y * d->stride, y, d->stride);
+    if (back_buffered)
+        memcpy(pixmap->devPrivate.ptr, d->data, d->bytes);
+
+    xorg_list_add(&d->link, &wlshm->retained);
+    d->retained = TRUE;
+    d->retained_since = GetTimeInMillis();
+    wlshm->retained_bytes += d->bytes;
+
+    return d;
+}
+
+static Bool
+test_budget_rows(const struct wlshm_pixmap *d, const void *data, int stride)
+{
+    int y, x;
+
+    for (y = 0; y < d->pixmap->drawable.height; y++)
+        for (x = 0; x < d->stride; x++)
+            if (((const uint8_t *)data)[(size_t)y * stride + x] != (uint8_t)y)
+                return FALSE;
+
+    return TRUE;
+}
+
+static void
+test_budget_drop(struct wlshm_device *wlshm, struct wlshm_pixmap *d)
+{
+    xorg_list_del(&d->link);
+    wlshm->retained_bytes -= d->bytes;
+    wlshm_budget_forget(wlshm, d);
+    wlshm_pool_put(&wlshm->pool, d->buffer);
+    free(d);
+}
+
+static void
+test_budget(void)
+{
+    static ScreenRec screen;
+    static ScrnInfoPtr screens[1] = { &wlshm_test_scrn };
+    struct wlshm_device *wlshm = calloc(1, sizeof(*wlshm));
+    PixmapRec pixmap = { { 24, 32, 0, 0, 640, 480, &screen } };
+    struct wlshm_pixmap *d;
+    void *orig;
+    int orig_stride = 640 * 4 + 64;
+
+    xf86Screens = screens;
+    wlshm_test_time = 0;
+    wlshm_pool_init(&wlshm->pool, &wlshm_test_scrn, 0, FALSE, 0);
+    xorg_list_init(&wlshm->pixmaps);
+    xorg_list_init(&wlshm->retained);
+    wlshm->budget = 1 << 20;
+    pixmap.devKind = 640 * 4;
+    pixmap.devPrivate.ptr = malloc((size_t)pixmap.devKind * 480);
+    orig = malloc((size_t)orig_stride * 480);
+
+    /* Just unmapped, maybe still on screen: left alone until the timer */
+    d = test_budget_retain(wlshm, &pixmap, FALSE);
+    wlshm_budget_enforce(wlshm);
+    check(!d->released);
+    check(wlshm->budget_timer != NULL);
+    wlshm_test_time += WLSHM_POOL_GRACE_MS - 1;
+    wlshm_test_run_timers();
+    check(!d->released);
+    wlshm_test_time += 1;
+    wlshm_test_run_timers();
+
+#ifdef HAVE_LZ4
+    /* Compressed, and the pages gone */
+    check(d->released);
+    check(d->compressed && d->compressed_size < d->bytes / 2);
+    check(wlshm->released_bytes == d->buffer->size);
+    check(wlshm->compressed_bytes == d->compressed_size);
+    check(((uint8_t *)d->data)[(size_t)100 * d->stride] == 0);
+
+    /* Mapped again */
+    wlshm_budget_restore(wlshm, d);
+    check(!d->released && !d->compressed);
+    check(wlshm->released_bytes == 0 && wlshm->compressed_bytes == 0);
+    check(test_budget_rows(d, d->data, d->stride));
+
+    /* Destroyed: straight out of the compressed copy, pages left alone */
+    wlshm_test_time += WLSHM_POOL_GRACE_MS;
+    wlshm_budget_enforce(wlshm);
+    check(d->released);
+    wlshm_budget_unpack(wlshm, d, orig, orig_stride);
+    check(test_budget_rows(d, orig, orig_stride));
+    check(((uint8_t *)d->data)[(size_t)100 * d->stride] == 0);
+    check(wlshm->stats.decompressions == 2);
+#else
+    /* Shm is the only copy, and there is nothing to compress it with */
+    check(!d->released);
+#endif
+    test_budget_drop(wlshm, d);
+    check(wlshm->released_bytes == 0 && wlshm->compressed_bytes == 0);
+
+    /* With a back buffer the shm pages are simply dropped and refilled */
+    d = test_budget_retain(wlshm, &pixmap, TRUE);
+    wlshm_test_time += WLSHM_POOL_GRACE_MS;
+    wlshm_budget_enforce(wlshm);
+    check(d->released && !d->compressed);
+    check(((uint8_t *)d->data)[(size_t)100 * d->stride] == 0);
+    wlshm_budget_restore(wlshm, d);
+    check(!d->released);
+    check(test_budget_rows(d, d->data, d->stride));
+    test_budget_drop(wlshm, d);
+
+    TimerFree(wlshm->budget_timer);
+    wlshm_pool_fini(&wlshm->pool);
+    check(wlshm->pool.buffers_created == wlshm->pool.buffers_destroyed);
+    free(pixmap.devPrivate.ptr);
+    free(orig);
+    free(wlshm);
+    xf86Screens = NULL;
+}
+
+static void
+test_copy_one(struct wlshm_threads *threads, int width, int height,
+              int dst_offset, int src_offset, Bool to_shm)
+{
+    /* Odd padding, so every row starts at a different alignment */
+    int dst_stride = width + dst_offset + 37;
+    int src_stride = width + src_offset + 19;
+    size_t dst_size = (size_t)dst_stride * (height + 2);
+    size_t src_size = (size_t)src_stride * height + src_offset;
+    uint8_t *dst = malloc(dst_size), *src = malloc(src_size);
+    uint8_t *d;
+    size_t i;
+    int x, y;
+
+    for (i = 0; i < src_size; i++)
+        src[i] = i * 7 + (i >> 11);
+    memset(dst, 0x5a, dst_size);
+
+    /* Leave a row above and below to catch overruns */
+    d = dst + dst_stride + dst_offset;
+    wlshm_copy_rect(threads, d, dst_stride, src + src_offset, src_stride,
+                    width, height, to_shm);
+
+    for (y = -1; y <= height; y++) {
+        for (x = -dst_offset; x < dst_stride - dst_offset; x++) {
+            uint8_t expect = 0x5a;
+
+            if (y >= 0 && y < height && x >= 0 && x < width)
+                expect = src[src_offset + (size_t)y * src_stride + x];
+            if (d[(ptrdiff_t)y * dst_stride + x] != expect) {
+                fprintf(stderr, "copy %dx%d+%d+%d%s: wrong byte at %d,%d\n",
+                        width, height, dst_offset, src_offset,
+                        to_shm ? " to shm" : "", x, y);
+                failures++;
+                goto out;
+            }
+        }
+    }
+
+out:
+    free(dst);
+    free(src);
+}
+
+static void
+test_copy(struct wlshm_threads *threads)
+{
+    static const int widths[] = { 1, 3, 15, 16, 17, 31, 33, 63, 64, 65,
+                                  127, 129, 1366 * 4, 1023 * 4 + 3 };
+    static const int offsets[] = { 0, 1, 15, 31 };
+    int w, o, to_shm;
+
+    for (to_shm = 0; to_shm <= 1; to_shm++) {
+        for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+            for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++)
+                test_copy_one(threads, widths[w], 5, offsets[o],
+                              offsets[(o + 1) % 4], to_shm);
+
+        /* Large enough to stream, and to split across threads */
+        test_copy_one(threads, 1920 * 4, 300, 0, 0, to_shm);
+        test_copy_one(threads, 1366 * 4 + 3, 600, 5, 12, to_shm);
+        test_copy_one(threads, 3840 * 4, 2160, 0, 0, to_shm);
+    }
+
+    /* Nothing to copy, nothing touched */
+    wlshm_copy_rect(threads, NULL, 0, NULL, 0, 0, 10, TRUE);
+    wlshm_copy_rect(threads, NULL, 0, NULL, 0, 10, 0, TRUE);
+}
+
+static void
+test_convert_one(struct wlshm_threads *threads, int width, int height)
+{
+    /* Strides in pixels, padded differently so rows start misaligned */
+    int dst_stride = width + 3, src_stride = width + 5;
+    uint32_t *dst = malloc((size_t)dst_stride * height * 4);
+    uint32_t *src = malloc((size_t)src_stride * height * 4);
+    uint32_t p, expect;
+    size_t i;
+    int x, y;
+
+    for (i = 0; i < (size_t)src_stride * height; i++)
+        src[i] = i * 2654435761u;
+    memset(dst, 0x5a, (size_t)dst_stride * height * 4);
+
+    wlshm_convert_rect(threads, dst, dst_stride * 4, src, src_stride * 4,
+                       width, height);
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < dst_stride; x++) {
+            p = src[(size_t)y * src_stride + x];
+            expect = 0x5a5a5a5a;
+            if (x < width)
+                expect = (p >> 22 & 0xff) << 16 | (p >> 12 & 0xff) << 8 |
+                    (p >> 2 & 0xff);
+            if (dst[(size_t)y * dst_stride + x] != expect) {
+                fprintf(stderr, "convert %dx%d: wrong pixel at %d,%d\n",
+                        width, height, x, y);
+                failures++;
+                goto out;
+            }
+        }
+    }
+
+out:
+    free(dst);
+    free(src);
+}
+
+static void
+test_convert(struct wlshm_threads *threads)
+{
+    static const int widths[] = { 1, 3, 4, 7, 8, 9, 15, 17, 1023 };
+    int w;
+
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+        test_convert_one(threads, widths[w], 3);
+
+    /* Large enough to split across threads */
+    test_convert_one(threads, 1366, 600);
+}
+
+static pixman_image_t *
+test_raster_image(pixman_format_code_t format, int width, int height,
+                  uint32_t seed)
+{
+    pixman_image_t *image;
+    uint32_t *bits;
+    int i, n;
+
+    image = pixman_image_create_bits(format, width, height, NULL, 0);
+    bits = pixman_image_get_data(image);
+    n = pixman_image_get_stride(image) / 4 * height;
+    for (i = 0; i < n; i++)
+        bits[i] = (i + seed) * 2654435761u;
+
+    return image;
+}
+
+/* Composite job in bands against one pixman call, to the bit */
+static void
+test_raster_composite_one(struct wlshm_threads *threads, pixman_op_t op,
+                          pixman_image_t *src, pixman_image_t *mask,
+                          int src_x, int src_y, int dest_x, int dest_y,
+                          int width, int height, int bands)
+{
+    int dest_width = dest_x + width + 3, dest_height = dest_y + height + 2;
+    pixman_image_t *expect, *dest;
+    struct wlshm_composite_images *images;
+    struct wlshm_composite_job job;
+    size_t size;
+    int i;
+
+    expect = test_raster_image(PIXMAN_a8r8g8b8, dest_width, dest_height, 7);
+    dest = test_raster_image(PIXMAN_a8r8g8b8, dest_width, dest_height, 7);
+    size = (size_t)pixman_image_get_stride(dest) * dest_height;
+
+    pixman_image_composite32(op, src, mask, expect, src_x, src_y,
+                             src_x + 1, src_y + 2, dest_x, dest_y,
+                             width, height);
+
+    /* What the server does: new images on the same bits for each band */
+    images = calloc(bands, sizeof(*images));
+    for (i = 0; i < bands; i++) {
+        images[i].src = pixman_image_ref(src);
+        images[i].mask = mask ? pixman_image_ref(mask) : NULL;
+        images[i].dest =
+            pixman_image_create_bits(PIXMAN_a8r8g8b8, dest_width,
+                                     dest_height,
+                                     pixman_image_get_data(dest),
+                                     pixman_image_get_stride(dest));
+    }
+
+    job.op = op;
+    job.images = images;
+    job.src_x = src_x;
+    job.src_y = src_y;
+    job.mask_x = src_x + 1;
+    job.mask_y = src_y + 2;
+    job.dest_x = dest_x;
+    job.dest_y = dest_y;
+    job.width = width;
+    job.height = height;
+    wlshm_raster_composite(threads, &job, bands);
+
+    if (memcmp(pixman_image_get_data(expect), pixman_image_get_data(dest),
+               size)) {
+        fprintf(stderr, "composite op %d %dx%d in %d bands: mismatch\n",
+                op, width, height, bands);
+        failures++;
+    }
+
+    for (i = 0; i < bands; i++) {
+        pixman_image_unref(images[i].src);
+        if (images[i].mask)
+            pixman_image_unref(images[i].mask);
+        pixman_image_unref(images[i].dest);
+    }
+    free(images);
+    pixman_image_unref(expect);
+    pixman_image_unref(dest);
+}
+
+static void
+test_raster_fill_one(struct wlshm_threads *threads, const BoxRec *boxes,
+                     int nbox)
+{
+    int width = 900, height = 700, stride = width + 5;
+    size_t size = (size_t)stride * height * 4;
+    uint32_t *expect = malloc(size), *bits = malloc(size);
+    int i;
+
+    memset(expect, 0x5a, size);
+    memset(bits, 0x5a, size);
+
+    for (i = 0; i < nbox; i++)
+        pixman_fill(expect, stride, 32, boxes[i].x1 + 3, boxes[i].y1 + 2,
+                    boxes[i].x2 - boxes[i].x1, boxes[i].y2 - boxes[i].y1,
+                    0x12345678);
+    wlshm_raster_fill(threads, bits, stride, 32, boxes, nbox, 3, 2,
+                      0x12345678);
+
+    if (memcmp(expect, bits, size)) {
+        fprintf(stderr, "fill of %d boxes: mismatch\n", nbox);
+        failures++;
+    }
+
+    free(expect);
+    free(bits);
+}
+
+static void
+test_raster(struct wlshm_threads *threads)
+{
+    static const BoxRec boxes[] = {
+        { 0, 0, 800, 40 },
+        { 10, 40, 20, 600 }, { 700, 40, 890, 600 },
+        { 0, 600, 890, 697 },
+        { 100, 100, 600, 101 }, { 5, 5, 5, 600 },
+    };
+    pixman_image_t *src, *mask, *tile;
+    int bands;
+
+    src = test_raster_image(PIXMAN_a8r8g8b8, 700, 560, 1);
+    mask = test_raster_image(PIXMAN_a8, 720, 580, 2);
+    tile = test_raster_image(PIXMAN_a8r8g8b8, 13, 7, 3);
+    pixman_image_set_repeat(tile, PIXMAN_REPEAT_NORMAL);
+
+    /* Anything large gets split when there are threads to split it to */
+    bands = wlshm_raster_bands(threads, 640 * 480, 480);
+    check(bands == (threads && threads->count ? min(threads->count + 1, 15)
+                    : 1));
+    check(wlshm_raster_bands(threads, 100 * 100, 100) == 1);
+    check(wlshm_raster_bands(threads, 1 << 20, 1) == 1);
+
+    for (bands = 1; bands <= 7; bands += 3) {
+        test_raster_composite_one(threads, PIXMAN_OP_OVER, src, mask,
+                                  5, 9, 11, 3, 640, 480, bands);
+        test_raster_composite_one(threads, PIXMAN_OP_SRC, tile, NULL,
+                                  -4, 3, 0, 0, 641, 479, bands);
+        test_raster_composite_one(threads, PIXMAN_OP_ADD, src, NULL,
+                                  0, 0, 2, 7, 699, 555, bands);
+    }
+
+    pixman_image_unref(src);
+    pixman_image_unref(mask);
+    pixman_image_unref(tile);
+
+    test_raster_fill_one(threads, boxes, sizeof(boxes) / sizeof(boxes[0]));
+    test_raster_fill_one(threads, boxes + 4, 1);
+}
+
+/* BT.601 limited range, as documented in wlshm_yuv.c */
+static uint32_t
+test_yuv_pixel(int y, int u, int v)
+{
+    int c, d, e, r, g, b;
+
+    y = y < 16 ? 16 : y > 235 ? 235 : y;
+    u = u < 16 ? 16 : u > 240 ? 240 : u;
+    v = v < 16 ? 16 : v > 240 ? 240 : v;
+    c = 149 * (y - 16) + 64;
+    d = u - 128;
+    e = v - 128;
+    r = (c + 204 * e) >> 7;
+    g = (c - 50 * d - 104 * e) >> 7;
+    b = (c + 258 * d) >> 7;
+    r = r < 0 ? 0 : r > 255 ? 255 : r;
+    g = g < 0 ? 0 : g > 255 ? 255 : g;
+    b = b < 0 ? 0 : b > 255 ? 255 : b;
+
+    return 0xff000000 | r << 16 | g << 8 | b;
+}
+
+/* What the destination pixel at x, y of job must be, sampled by hand */
+static uint32_t
+test_yuv_expect(const struct wlshm_yuv_job *job, int x, int y)
+{
+    int sx = (job->sx0 + (int64_t)(x - job->drw_x) * job->sx_step) >> 16;
+    int sy = (job->sy0 + (int64_t)(y - job->drw_y) * job->sy_step) >> 16;
+    const uint8_t *row = job->planes[0] + sy * job->pitches[0];
+    const uint8_t *u, *v;
+
+    /* Chroma of the pair sx falls in, whatever the clip start */
+    switch (job->format) {
+    case WLSHM_YUV_YUY2:
+        return test_yuv_pixel(row[sx * 2], row[(sx & ~1) * 2 + 1],
+                              row[(sx & ~1) * 2 + 3]);
+    case WLSHM_YUV_NV12:
+        u = job->planes[1] + sy / 2 * job->pitches[1] + (sx & ~1);
+        return test_yuv_pixel(row[sx], u[0], u[1]);
+    default:
+        u = job->planes[1] + sy / 2 * job->pitches[1] + sx / 2;
+        v = job->planes[2] + sy / 2 * job->pitches[2] + sx / 2;
+        return test_yuv_pixel(row[sx], *u, *v);
+    }
+}
+
+static void
+test_yuv_one(struct wlshm_threads *threads, struct wlshm_yuv_job *job,
+             const char *kernel, const char *what)
+{
+    static const char *formats[] = { "YUY2", "planar", "NV12" };
+    uint32_t *dst = (uint32_t *)job->dst, expect;
+    int x, y, stride = job->dst_stride / 4, height = job->box.y2 + 2;
+
+    memset(job->dst, 0x5a, (size_t)job->dst_stride * height);
+    wlshm_threads_run(threads, 3, wlshm_yuv_band, job);
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < stride; x++) {
+            expect = 0x5a5a5a5a;
+            if (x >= job->box.x1 && x < job->box.x2 &&
+                y >= job->box.y1 && y < job->box.y2)
+                expect = test_yuv_expect(job, x, y);
+            if (dst[(size_t)y * stride + x] != expect) {
+                fprintf(stderr, "yuv %s %s, %s kernel: wrong pixel at "
+                        "%d,%d\n", formats[job->format], what, kernel, x, y);
+                failures++;
+                return;
+            }
+        }
+    }
+}
+
+static void
+test_yuv(struct wlshm_threads *threads)
+{
+    /* Even, like the Xv image sizes; odd strides */
+    enum { W = 100, H = 40, DST_W = 160, SRC_SIZE = (W * 2 + 4) * H };
+    uint8_t *src = malloc(SRC_SIZE), *dst = malloc(DST_W * 4 * (H + 4));
+    struct wlshm_yuv_job job;
+    const char *kernel;
+    int i, n, f;
+
+    for (i = 0; i < SRC_SIZE; i++)
+        src[i] = i * 131 + (i >> 7);
+
+    for (n = 0; (kernel = wlshm_yuv_use_kernel(n)); n++) {
+        for (f = WLSHM_YUV_YUY2; f <= WLSHM_YUV_NV12; f++) {
+            memset(&job, 0, sizeof(job));
+            job.format = f;
+            job.planes[0] = src;
+            switch (f) {
+            case WLSHM_YUV_YUY2:
+                job.pitches[0] = W * 2 + 4;
+                break;
+            case WLSHM_YUV_PLANAR:
+                job.pitches[0] = W + 4;
+                job.planes[1] = src + (W + 4) * H;
+                job.planes[2] = job.planes[1] + (W / 2 + 2) * (H / 2);
+                job.pitches[1] = job.pitches[2] = W / 2 + 2;
+                break;
+            case WLSHM_YUV_NV12:
+                job.pitches[0] = job.pitches[1] = W + 4;
+                job.planes[1] = src + (W + 4) * H;
+                break;
+            }
+            job.dst = dst;
+            job.dst_stride = DST_W * 4;
+
+            /* Unscaled, drawn at 5,1, clipped to start on even and odd */
+            job.sx_step = job.sy_step = 1 << 16;
+            job.sx0 = job.sy0 = 1 << 15;
+            job.drw_x = 5;
+            job.drw_y = 1;
+            job.box.x1 = 5;
+            job.box.y1 = 1;
+            job.box.x2 = 5 + W;
+            job.box.y2 = 1 + H;
+            test_yuv_one(threads, &job, kernel, "unscaled");
+            job.box.x1 = 8;
+            job.box.x2 = 5 + W - 3;
+            job.box.y1 = 4;
+            test_yuv_one(threads, &job, kernel, "unscaled, odd clip");
+
+            /* Scaled up by 3/2 from source 3,2, clipped at odd pixels */
+            job.sx_step = job.sy_step = (2 << 16) / 3;
+            job.sx0 = (3 << 16) + job.sx_step / 2;
+            job.sy0 = (2 << 16) + job.sy_step / 2;
+            job.box.x1 = 7;
+            job.box.x2 = 5 + (W - 4) * 3 / 2;
+            job.box.y1 = 2;
+            job.box.y2 = 1 + (H - 3) * 3 / 2 - 20;
+            test_yuv_one(threads, &job, kernel, "scaled");
+        }
+    }
+
+    wlshm_yuv_init();
+    free(src);
+    free(dst);
+}
+
+static void
+test_tiles(void)
+{
+    struct wlshm_pixmap d;
+    PixmapRec pixmap;
+    RegionRec damage;
+    BoxRec box = { 0, 0, 300, 200 };
+    BoxRec small = { 10, 10, 20, 20 };
+    uint8_t *bits, *row, stripe[32];
+    uint64_t left_out;
+    size_t i;
+
+    memset(&pixmap, 0, sizeof(pixmap));
+    pixmap.drawable.width = 300;
+    pixmap.drawable.height = 200;
+    pixmap.drawable.bitsPerPixel = 32;
+    pixmap.devKind = 300 * 4 + 16;
+    bits = malloc((size_t)pixmap.devKind * 200);
+    for (i = 0; i < (size_t)pixmap.devKind * 200; i++)
+        bits[i] = i * 13 + (i >> 8);
+    pixmap.devPrivate.ptr = bits;
+
+    memset(&d, 0, sizeof(d));
+    d.pixmap = &pixmap;
+    check(wlshm_tiles_attach(&d));
+    check(d.tiles_x == 5 && d.tiles_y == 4);
+
+    /* A pixel in tile 1,1 and one in the bottom right, partial, tile */
+    bits[(size_t)70 * pixmap.devKind + 70 * 4] ^= 1;
+    bits[(size_t)199 * pixmap.devKind + 299 * 4 + 3] ^= 0x80;
+
+    /* Two 32 byte stripes of a row of tile 2,0 swapped */
+    row = bits + (size_t)5 * pixmap.devKind + 128 * 4;
+    memcpy(stripe, row, 32);
+    memcpy(row, row + 32, 32);
+    memcpy(row + 32, stripe, 32);
+
+    /* Tile 0,0 drawn again with the same pixels */
+    memcpy(stripe, bits, 32);
+    memcpy(bits, stripe, 32);
+
+    RegionInit(&damage, &box, 1);
+    left_out = wlshm_tiles_filter(NULL, &d, &damage);
+    check(wlshm_region_area(&damage) == 64 * 64 * 2 + 44 * 8);
+    check(left_out == 300 * 200 - wlshm_region_area(&damage));
+
+    /* Nothing changed since */
+    RegionUninit(&damage);
+    RegionInit(&damage, &box, 1);
+    check(wlshm_tiles_filter(NULL, &d, &damage) == 300 * 200);
+    check(!RegionNotEmpty(&damage));
+
+    /* Damage in changed tiles only is left alone */
+    bits[15 * pixmap.devKind + 15 * 4] ^= 1;
+    RegionUninit(&damage);
+    RegionInit(&damage, &small, 1);
+    check(wlshm_tiles_filter(NULL, &d, &damage) == 0);
+    check(wlshm_region_area(&damage) == 100);
+
+    RegionUninit(&damage);
+    wlshm_tiles_detach(&d);
+    free(bits);
+}
+
+/* out must cover damage, with overdraw accounting for what it adds */
+static void
+check_reduced(RegionPtr damage, RegionPtr out, uint64_t overdraw)
+{
+    RegionRec both;
+
+    RegionNull(&both);
+    RegionIntersect(&both, out, damage);
+    check(wlshm_region_area(&both) == wlshm_region_area(damage));
+    check(overdraw == wlshm_region_area(out) - wlshm_region_area(damage));
+    RegionUninit(&both);
+}
+
+static void
+test_damage(void)
+{
+    BoxRec boxes[] = {
+        { 0, 0, 10, 10 }, { 12, 0, 22, 10 }, { 100, 100, 110, 110 },
+    };
+    RegionRec damage, out, tmp;
+    uint64_t overdraw = 0;
+    BoxRec box;
+    int i;
+
+    /* The close pair is merged, the far box costs too much to */
+    RegionNull(&damage);
+    for (i = 0; i < 3; i++) {
+        RegionInit(&tmp, &boxes[i], 1);
+        RegionUnion(&damage, &damage, &tmp);
+        RegionUninit(&tmp);
+    }
+    check(wlshm_damage_reduce(&damage, &out, 16, 4096, &overdraw));
+    check(RegionNumRects(&out) == 2);
+    check(overdraw == 20);
+    check_reduced(&damage, &out, overdraw);
+    RegionUninit(&out);
+
+    /* Nothing is cheap enough to merge with few rectangles */
+    overdraw = 0;
+    check(!wlshm_damage_reduce(&damage, &out, 16, 10, &overdraw));
+    check(overdraw == 0);
+
+    /* Down to max_rects whatever it costs */
+    check(wlshm_damage_reduce(&damage, &out, 1, 0, &overdraw));
+    check(RegionNumRects(&out) == 1);
+    check_reduced(&damage, &out, overdraw);
+    RegionUninit(&out);
+    RegionUninit(&damage);
+
+    /* Scattered glyphs, some overlapping */
+    RegionNull(&damage);
+    srand(1);
+    for (i = 0; i < 100; i++) {
+        box.x1 = rand() % 1000;
+        box.y1 = rand() % 1000;
+        box.x2 = box.x1 + 4 + rand() % 20;
+        box.y2 = box.y1 + 8 + rand() % 12;
+        RegionInit(&tmp, &box, 1);
+        RegionUnion(&damage, &damage, &tmp);
+        RegionUninit(&tmp);
+    }
+    check(RegionNumRects(&damage) > 16);
+    overdraw = 0;
+    check(wlshm_damage_reduce(&damage, &out, 16, 4096, &overdraw));
+    check(RegionNumRects(&out) <= 16);
+    check_reduced(&damage, &out, overdraw);
+    RegionUninit(&out);
+    RegionUninit(&damage);
+
+    /* Too many to search pairwise: the bounding box */
+    RegionNull(&damage);
+    for (i = 0; i < 200; i++) {
+        box.x1 = i * 4;
+        box.y1 = i & 1;
+        box.x2 = box.x1 + 2;
+        box.y2 = box.y1 + 1;
+        RegionInit(&tmp, &box, 1);
+        RegionUnion(&damage, &damage, &tmp);
+        RegionUninit(&tmp);
+    }
+    overdraw = 0;
+    check(wlshm_damage_reduce(&damage, &out, 16, 4096, &overdraw));
+    check(RegionNumRects(&out) == 1);
+    check_reduced(&damage, &out, overdraw);
+    RegionUninit(&out);
+    RegionUninit(&damage);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct wlshm_threads threads;
+
+    test_pool_size_classes();
+    test_pool_grace();
+    test_pool_limit();
+    test_pool_prep();
+    test_budget();
+
+    wlshm_copy_init();
+    printf("copy kernel: %s\n", wlshm_copy_kernel_name());
+    test_copy(NULL);
+    wlshm_convert_init();
+    printf("convert kernel: %s\n", wlshm_convert_kernel_name());
+    test_convert(NULL);
+    test_raster(NULL);
+    wlshm_yuv_init();
+    printf("yuv kernel: %s\n", wlshm_yuv_kernel_name());
+    test_yuv(NULL);
+    if (wlshm_threads_init(&threads, &wlshm_test_scrn, WLSHM_DEFAULT_THREADS)) {
+        test_copy(&threads);
+        test_convert(&threads);
+        test_raster(&threads);
+        test_yuv(&threads);
+        wlshm_threads_fini(&threads);
+    }
+
+    wlshm_tiles_init();
+    printf("tile hash: %s\n", wlshm_tiles_kernel_name());
+    test_tiles();
+
+    test_damage();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
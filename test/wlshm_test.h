@@ -0,0 +1,15 @@
+#ifndef _WLSHM_TEST_H_
+#define _WLSHM_TEST_H_
+
+#include "wlshm.h"
+
+/* What GetTimeInMillis() returns, see stubs.c */
+extern CARD32 wlshm_test_time;
+
+/* Run the timers due by wlshm_test_time, see stubs.c */
+void wlshm_test_run_timers(void);
+
+/* Wait for the pool's prep thread to have nothing left to do */
+Bool wlshm_test_wait_prep(struct wlshm_pool *pool);
+
+#endif